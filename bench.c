@@ -0,0 +1,984 @@
+/* bench.c
+---------------
+ Microbenchmarks for the allocator hot paths. Each scenario isolates one cost (a fixed-size
+ alloc/free loop, random-size churn, realloc growth, a long free-list walk, a chain of
+ coalesces, cross-thread ping-pong, random access to blocks spread over the heap, reopening a
+ persistent heap compared with rebuilding its contents, searching a long scattered free list
+ with and without the search table, churn with and without size classes, threads incrementing
+ counters packed together or on separate cache lines, churn with guarded sampling, freeing
+ guarded blocks with latency recording on, walking a heap larger than the last-level cache
+ with and without prefetching, and filling a small heap with small blocks to measure
+ utilization) and reports nanoseconds, instructions, cache misses and dTLB load misses per
+ operation. The counts come from perf_event_open and are shown as n/a when the kernel does
+ not allow it. Scenarios that first build a large heap do so in a setup that is neither timed
+ nor counted.
+
+ The same source is built once per allocator:
+
+   gcc -O2 -DBENCH_EXPLICIT -o bench_explicit bench.c explicit.c -lpthread
+   gcc -O2 -DBENCH_IMPLICIT -o bench_implicit bench.c implicit.c -lpthread
+   gcc -O2 -DBENCH_IMPLICIT -DCOMPACT_HEADER -o bench_compact bench.c implicit.c -lpthread
+   gcc -O2 -DBENCH_LIBC -o bench_libc bench.c -lpthread
+
+ Usage: ./bench_explicit [scenario] [iterations]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#ifdef BENCH_LIBC
+#define ALLOCATOR_NAME "glibc"
+typedef struct heap heap;
+
+heap* myinit_ex(void* heap_start, size_t heap_size) {
+    (void)heap_size;
+    return (heap*)heap_start;
+}
+void* mymalloc_ex(heap* h, size_t requested_size) {
+    (void)h;
+    return malloc(requested_size);
+}
+void myfree_ex(heap* h, void* ptr) {
+    (void)h;
+    free(ptr);
+}
+void* myrealloc_ex(heap* h, void* old_ptr, size_t new_size) {
+    (void)h;
+    return realloc(old_ptr, new_size);
+}
+#else
+#include "heap.h"
+#if defined(BENCH_IMPLICIT) && defined(COMPACT_HEADER)
+#define ALLOCATOR_NAME "compact"
+#elif defined(BENCH_IMPLICIT)
+#define ALLOCATOR_NAME "implicit"
+#else
+#define ALLOCATOR_NAME "explicit"
+#endif
+#endif
+
+#define HEAP_BYTES (256UL << 20)
+
+// struct used to store the memory handed to each scenario's heap.
+typedef struct bench_ctx {
+    void* memory;
+    heap* h;
+    uint64_t rng;
+} bench_ctx;
+
+// a scenario runs the given number of iterations and returns the number of operations performed
+typedef size_t (*scenario_fn)(bench_ctx* ctx, size_t iterations);
+
+// a setup prepares the fresh heap before a scenario runs, outside the timed and counted region
+typedef void (*setup_fn)(bench_ctx* ctx);
+
+// struct used to describe one benchmark scenario.
+typedef struct scenario {
+    const char* name;
+    scenario_fn run;
+    size_t iterations; // default when none is given on the command line
+    setup_fn setup; // NULL when the scenario builds everything it needs inside its run
+} scenario;
+
+/* next_random
+----------------
+ Advances the scenario's xorshift generator.
+
+ @param ctx: the benchmark context
+ @return: a pseudo-random 64-bit value
+*/
+uint64_t next_random(bench_ctx* ctx) {
+    uint64_t x = (*ctx).rng;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    (*ctx).rng = x;
+    return x;
+}
+
+/* fresh_heap
+---------------
+ Reinitializes the scenario heap so every scenario starts from an empty segment.
+
+ @param ctx: the benchmark context
+*/
+void fresh_heap(bench_ctx* ctx) {
+    (*ctx).h = myinit_ex((*ctx).memory, HEAP_BYTES);
+    (*ctx).rng = 0x2545F4914F6CDD1DULL;
+}
+
+/* run_fixed
+--------------
+ Allocates and immediately frees a 64-byte block.
+*/
+size_t run_fixed(bench_ctx* ctx, size_t iterations) {
+    for (size_t i = 0; i < iterations; i++) {
+        void* ptr = mymalloc_ex((*ctx).h, 64);
+        *(volatile char*)ptr = 1;
+        myfree_ex((*ctx).h, ptr);
+    }
+    return iterations * 2;
+}
+
+/* run_churn
+--------------
+ Replaces a random slot of a 4096-entry working set with a new block of random size,
+ mostly small with an occasional large one.
+*/
+size_t run_churn(bench_ctx* ctx, size_t iterations) {
+    enum { SLOTS = 4096 };
+    static void* slots[SLOTS];
+    memset(slots, 0, sizeof(slots));
+
+    for (size_t i = 0; i < iterations; i++) {
+        uint64_t r = next_random(ctx);
+        size_t slot = r % SLOTS;
+        size_t size = (r >> 32) % 16 == 0 ? 1 + (r >> 20) % 8192 : 1 + (r >> 20) % 256;
+        myfree_ex((*ctx).h, slots[slot]);
+        slots[slot] = mymalloc_ex((*ctx).h, size);
+    }
+    for (size_t i = 0; i < SLOTS; i++) {
+        myfree_ex((*ctx).h, slots[i]);
+    }
+    return iterations * 2;
+}
+
+/* run_realloc
+----------------
+ Grows a buffer from 16 bytes to 64 KiB in steps of 16 bytes plus an eighth of its size,
+ the pattern of an appending string builder, then frees it.
+*/
+size_t run_realloc(bench_ctx* ctx, size_t iterations) {
+    size_t ops = 0;
+    for (size_t i = 0; i < iterations; i++) {
+        void* ptr = NULL;
+        for (size_t size = 16; size <= 65536; size += 16 + size / 8) {
+            ptr = myrealloc_ex((*ctx).h, ptr, size);
+            ops++;
+        }
+        myfree_ex((*ctx).h, ptr);
+        ops++;
+    }
+    return ops;
+}
+
+/* run_freelist
+-----------------
+ Fills the heap so that its only free blocks are 10000 holes too small for the request,
+ then asks for a larger block so every allocation walks the whole free list before
+ failing. With glibc the request simply succeeds, which is the baseline to compare with.
+*/
+size_t run_freelist(bench_ctx* ctx, size_t iterations) {
+    enum { HOLES = 10000 };
+    static void* holes[HOLES];
+    for (size_t i = 0; i < HOLES; i++) {
+        holes[i] = mymalloc_ex((*ctx).h, 32);
+        mymalloc_ex((*ctx).h, 16); //fence keeping the holes apart
+    }
+#ifndef BENCH_LIBC
+    for (size_t size = HEAP_BYTES; size >= 16; ) { //use up the rest of the segment
+        if (mymalloc_ex((*ctx).h, size) == NULL) {
+            size /= 2;
+        }
+    }
+#endif
+    for (size_t i = 0; i < HOLES; i++) {
+        myfree_ex((*ctx).h, holes[i]);
+    }
+
+    for (size_t i = 0; i < iterations; i++) {
+        void* ptr = mymalloc_ex((*ctx).h, 256);
+        myfree_ex((*ctx).h, ptr);
+    }
+    return iterations;
+}
+
+/* run_coalesce
+-----------------
+ Allocates 1000 adjacent blocks and frees them from the last to the first, so every free
+ merges with the block after it.
+*/
+size_t run_coalesce(bench_ctx* ctx, size_t iterations) {
+    enum { CHAIN = 1000 };
+    static void* chain[CHAIN];
+    for (size_t i = 0; i < iterations; i++) {
+        for (size_t j = 0; j < CHAIN; j++) {
+            chain[j] = mymalloc_ex((*ctx).h, 48);
+        }
+        for (size_t j = CHAIN; j > 0; j--) {
+            myfree_ex((*ctx).h, chain[j - 1]);
+        }
+    }
+    return iterations * CHAIN * 2;
+}
+
+#define RING_SIZE 1024
+
+// struct used to pass blocks from the allocating thread to the freeing thread.
+typedef struct ring {
+    void* slots[RING_SIZE];
+    size_t head; // written by the producer
+    size_t tail; // written by the consumer
+    size_t count;
+    bench_ctx* ctx;
+    pthread_mutex_t lock; // the allocators are not thread-safe, so heap calls are serialized
+} ring;
+
+/* pingpong_consumer
+----------------------
+ Frees every block the producer passes through the ring.
+*/
+void* pingpong_consumer(void* arg) {
+    ring* r = (ring*)arg;
+    for (size_t i = 0; i < (*r).count; i++) {
+        while (__atomic_load_n(&(*r).head, __ATOMIC_ACQUIRE) == (*r).tail) {
+        }
+        void* ptr = (*r).slots[(*r).tail % RING_SIZE];
+        pthread_mutex_lock(&(*r).lock);
+        myfree_ex((*(*r).ctx).h, ptr);
+        pthread_mutex_unlock(&(*r).lock);
+        __atomic_store_n(&(*r).tail, (*r).tail + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+/* run_pingpong
+-----------------
+ Allocates blocks on this thread and frees them on another, handing them over through a
+ single-producer single-consumer ring.
+*/
+size_t run_pingpong(bench_ctx* ctx, size_t iterations) {
+    static ring r;
+    r.head = 0;
+    r.tail = 0;
+    r.count = iterations;
+    r.ctx = ctx;
+    pthread_mutex_init(&r.lock, NULL);
+
+    pthread_t consumer;
+    pthread_create(&consumer, NULL, pingpong_consumer, &r);
+    for (size_t i = 0; i < iterations; i++) {
+        while (r.head - __atomic_load_n(&r.tail, __ATOMIC_ACQUIRE) == RING_SIZE) {
+        }
+        pthread_mutex_lock(&r.lock);
+        void* ptr = mymalloc_ex((*ctx).h, 64 + (i % 4) * 32);
+        pthread_mutex_unlock(&r.lock);
+        r.slots[r.head % RING_SIZE] = ptr;
+        __atomic_store_n(&r.head, r.head + 1, __ATOMIC_RELEASE);
+    }
+    pthread_join(consumer, NULL);
+    pthread_mutex_destroy(&r.lock);
+    return iterations * 2;
+}
+
+#ifdef BENCH_EXPLICIT
+/* chase_nodes
+----------------
+ Links about a million 64-byte blocks into one random cycle and follows it, so every step 
+ touches a block on an unpredictable page. The blocks are interleaved with larger ones 
+ that are freed again, spreading the nodes over the whole heap.
+
+ @param h: the heap to allocate the nodes from
+ @param ctx: the benchmark context, for its random generator
+ @param iterations: the number of steps to take
+ @return: the number of steps taken
+*/
+size_t chase_nodes(heap* h, bench_ctx* ctx, size_t iterations) {
+    enum { NODES = 1 << 20 };
+    static void** nodes[NODES];
+    for (size_t i = 0; i < NODES; i++) {
+        nodes[i] = mymalloc_ex(h, 64);
+        mymalloc_ex(h, 128); //spacer, left allocated so the nodes stay spread out
+    }
+    for (size_t i = NODES - 1; i > 0; i--) { //shuffle, then link in the shuffled order
+        size_t j = next_random(ctx) % (i + 1);
+        void** tmp = nodes[i];
+        nodes[i] = nodes[j];
+        nodes[j] = tmp;
+    }
+    for (size_t i = 0; i < NODES; i++) {
+        *nodes[i] = nodes[(i + 1) % NODES];
+    }
+
+    void** curr = nodes[0];
+    for (size_t i = 0; i < iterations; i++) {
+        curr = (void**)*curr;
+    }
+    *(void* volatile*)&nodes[0] = curr;
+    return iterations;
+}
+
+/* run_tlb
+------------
+ Random pointer chasing over blocks of the regular, 4 KiB-page heap.
+*/
+size_t run_tlb(bench_ctx* ctx, size_t iterations) {
+    return chase_nodes((*ctx).h, ctx, iterations);
+}
+
+/* run_tlb_huge
+-----------------
+ The same walk over a heap created with myinit_mapped(HEAP_MAP_HUGE), to compare dTLB 
+ misses with run_tlb.
+*/
+size_t run_tlb_huge(bench_ctx* ctx, size_t iterations) {
+    heap* h = myinit_mapped(HEAP_BYTES, HEAP_MAP_HUGE);
+    if (h == NULL) {
+        fprintf(stderr, "could not map a huge-page heap\n");
+        return 1;
+    }
+    size_t ops = chase_nodes(h, ctx, iterations);
+    heap_unmap(h);
+    return ops;
+}
+
+#define INDEX_BUCKETS (1 << 16)
+#define INDEX_ENTRIES (1 << 19)
+
+// struct used to store one entry of the index built by the persistence scenarios.
+typedef struct index_entry {
+    size_t next; // heap offset of the next entry in the bucket, 0 at the end
+    uint64_t key;
+    char value[48];
+} index_entry;
+
+/* build_index
+----------------
+ Fills a heap with a hash index of INDEX_ENTRIES entries whose links are heap offsets, 
+ the way data must be stored in a persistent heap, and makes the bucket table its root.
+
+ @param h: the heap to fill
+ @param ctx: the benchmark context, for its random generator
+ @return: true if the index was built, false if the heap ran out of memory
+*/
+bool build_index(heap* h, bench_ctx* ctx) {
+    size_t* buckets = mymalloc_ex(h, INDEX_BUCKETS * sizeof(size_t));
+    if (buckets == NULL) {
+        return false;
+    }
+    memset(buckets, 0, INDEX_BUCKETS * sizeof(size_t));
+    for (size_t i = 0; i < INDEX_ENTRIES; i++) {
+        index_entry* entry = mymalloc_ex(h, sizeof(index_entry));
+        if (entry == NULL) {
+            return false;
+        }
+        (*entry).key = next_random(ctx);
+        memset((*entry).value, (int)i, sizeof((*entry).value));
+        size_t* bucket = &buckets[(*entry).key % INDEX_BUCKETS];
+        (*entry).next = *bucket;
+        *bucket = heap_offset(h, entry);
+    }
+    heap_set_root(h, buckets);
+    return true;
+}
+
+/* make_holes
+----------------
+ Leaves 262144 holes spread over 64 MiB as the only free blocks, freed in random order so 
+ that neighbours on the free list are far apart in memory.
+
+ @param ctx: the benchmark context
+*/
+void make_holes(bench_ctx* ctx) {
+    enum { HOLES = 1 << 18 };
+    static void* holes[HOLES];
+    for (size_t i = 0; i < HOLES; i++) {
+        holes[i] = mymalloc_ex((*ctx).h, 48);
+        mymalloc_ex((*ctx).h, 192); //fence keeping the holes apart
+    }
+    for (size_t size = HEAP_BYTES; size >= 16; ) { //use up the rest of the segment
+        if (mymalloc_ex((*ctx).h, size) == NULL) {
+            size /= 2;
+        }
+    }
+    for (size_t i = HOLES - 1; i > 0; i--) {
+        size_t j = next_random(ctx) % (i + 1);
+        void* tmp = holes[i];
+        holes[i] = holes[j];
+        holes[j] = tmp;
+    }
+    for (size_t i = 0; i < HOLES; i++) {
+        myfree_ex((*ctx).h, holes[i]);
+    }
+}
+
+/* setup_search
+-----------------
+ Makes the holes in a heap that searches its free list.
+*/
+void setup_search(bench_ctx* ctx) {
+    heap_set_search_table((*ctx).h, false);
+    make_holes(ctx);
+}
+
+/* setup_search_table
+-----------------------
+ Makes the holes in a heap that keeps its search table.
+*/
+void setup_search_table(bench_ctx* ctx) {
+    heap_set_search_table((*ctx).h, true);
+    make_holes(ctx);
+}
+
+/* search_holes
+------------------
+ Asks for a block none of the holes can hold, so every allocation searches all of them 
+ before failing.
+
+ @param ctx: the benchmark context
+ @param iterations: the number of searches
+ @return: the number of searches
+*/
+size_t search_holes(bench_ctx* ctx, size_t iterations) {
+    for (size_t i = 0; i < iterations; i++) {
+        void* ptr = mymalloc_ex((*ctx).h, 256);
+        myfree_ex((*ctx).h, ptr);
+    }
+    heap_set_search_table((*ctx).h, false);
+    return iterations;
+}
+
+/* churn_classes
+-------------------
+ Replaces a random slot of a 4096-entry working set with a block whose size is spread evenly 
+ over the powers of two up to 4 KiB. It then prints the padding added by rounding the 
+ live requests, as a share of their rounded size. It also prints how much larger the 
+ allocated payload is than the requests, which includes free blocks handed out whole.
+
+ @param ctx: the benchmark context
+ @param iterations: the number of replacements
+ @param classes: whether requests are rounded to size classes
+ @return: the number of allocations and frees
+*/
+size_t churn_classes(bench_ctx* ctx, size_t iterations, bool classes) {
+    enum { SLOTS = 4096 };
+    static void* slots[SLOTS];
+    static size_t sizes[SLOTS];
+    memset(slots, 0, sizeof(slots));
+    memset(sizes, 0, sizeof(sizes));
+    heap_set_size_classes((*ctx).h, classes);
+
+    size_t requested = 0;
+    size_t rounded = 0;
+    for (size_t i = 0; i < iterations; i++) {
+        uint64_t r = next_random(ctx);
+        size_t slot = r % SLOTS;
+        size_t size = 1 + (r >> 32) % (2UL << ((r >> 16) % 12));
+        myfree_ex((*ctx).h, slots[slot]);
+        requested -= sizes[slot];
+        rounded -= sizes[slot] != 0 ? heap_good_size((*ctx).h, sizes[slot]) : 0;
+        slots[slot] = mymalloc_ex((*ctx).h, size);
+        sizes[slot] = slots[slot] != NULL ? size : 0;
+        requested += sizes[slot];
+        rounded += sizes[slot] != 0 ? heap_good_size((*ctx).h, sizes[slot]) : 0;
+    }
+
+    heap_stats stats;
+    mystats_ex((*ctx).h, &stats);
+    printf("# %s: rounding pads requests by %.1f%%, allocated payload is %.2fx the requests\n",
+           classes ? "size classes" : "8-byte rounding",
+           100.0 * (double)(rounded - requested) / (double)rounded,
+           (double)stats.bytes_allocated / (double)requested);
+    for (size_t i = 0; i < SLOTS; i++) {
+        myfree_ex((*ctx).h, slots[i]);
+    }
+    heap_set_size_classes((*ctx).h, false);
+    return iterations * 2;
+}
+
+/* run_frag
+-------------
+ Churns random sizes with requests rounded to a multiple of 8 bytes.
+*/
+size_t run_frag(bench_ctx* ctx, size_t iterations) {
+    return churn_classes(ctx, iterations, false);
+}
+
+/* run_frag_classes
+---------------------
+ Churns the same sizes with requests rounded to size classes.
+*/
+size_t run_frag_classes(bench_ctx* ctx, size_t iterations) {
+    return churn_classes(ctx, iterations, true);
+}
+
+#define COUNTER_THREADS 4
+
+// struct used to pass one counting thread its counter.
+typedef struct counter_arg {
+    size_t* counter;
+    size_t iterations;
+} counter_arg;
+
+/* count_up
+-------------
+ Increments the thread's counter the given number of times.
+*/
+void* count_up(void* arg) {
+    counter_arg* c = (counter_arg*)arg;
+    for (size_t i = 0; i < (*c).iterations; i++) {
+        __atomic_fetch_add((*c).counter, 1, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+/* count_threads
+------------------
+ Allocates one 8-byte counter per thread back to back, then has every thread increment its 
+ own counter. Each thread is pinned to a CPU of its own, so without padding the counters 
+ share a cache line that bounces between the cores on every increment. Runs one thread per 
+ available CPU up to COUNTER_THREADS, and is skipped when fewer than 2 CPUs are available.
+
+ @param ctx: the benchmark context
+ @param iterations: the number of increments per thread
+ @param padded: whether counters get cache lines of their own
+ @return: the number of increments, or 0 if skipped
+*/
+size_t count_threads(bench_ctx* ctx, size_t iterations, bool padded) {
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        CPU_ZERO(&allowed);
+    }
+    int cpus[COUNTER_THREADS];
+    size_t count = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE && count < COUNTER_THREADS; cpu++) {
+        if (CPU_ISSET(cpu, &allowed)) {
+            cpus[count++] = cpu;
+        }
+    }
+    if (count < 2) {
+        printf("# %s: skipped, needs 2 CPUs and %zu available\n", padded ? "cache lines" : "packed",
+               count);
+        return 0;
+    }
+
+    heap_set_cache_lines((*ctx).h, padded ? 1 : 0);
+    counter_arg args[COUNTER_THREADS];
+    pthread_t threads[COUNTER_THREADS];
+    for (size_t i = 0; i < count; i++) {
+        args[i].counter = mymalloc_ex((*ctx).h, sizeof(size_t));
+        *args[i].counter = 0;
+        args[i].iterations = iterations;
+    }
+    printf("# %s: %zu threads, counters %zu bytes apart\n", padded ? "cache lines" : "packed",
+           count, (size_t)((char*)args[1].counter - (char*)args[0].counter));
+    for (size_t i = 0; i < count; i++) {
+        pthread_attr_t attr;
+        cpu_set_t cpu;
+        CPU_ZERO(&cpu);
+        CPU_SET(cpus[i], &cpu);
+        pthread_attr_init(&attr);
+        pthread_attr_setaffinity_np(&attr, sizeof(cpu), &cpu);
+        pthread_create(&threads[i], &attr, count_up, &args[i]);
+        pthread_attr_destroy(&attr);
+    }
+    for (size_t i = 0; i < count; i++) {
+        pthread_join(threads[i], NULL);
+        myfree_ex((*ctx).h, args[i].counter);
+    }
+    heap_set_cache_lines((*ctx).h, 0);
+    return iterations * count;
+}
+
+/* run_counters
+-----------------
+ Counts on threads whose counters are packed next to each other.
+*/
+size_t run_counters(bench_ctx* ctx, size_t iterations) {
+    return count_threads(ctx, iterations, false);
+}
+
+/* run_counters_padded
+------------------------
+ Counts on threads whose counters have cache lines of their own.
+*/
+size_t run_counters_padded(bench_ctx* ctx, size_t iterations) {
+    return count_threads(ctx, iterations, true);
+}
+
+#define GUARD_RATE 10000
+
+/* run_churn_guarded
+----------------------
+ The churn scenario with one in GUARD_RATE allocations sent to guarded pages, to measure 
+ what guarded sampling costs.
+*/
+size_t run_churn_guarded(bench_ctx* ctx, size_t iterations) {
+    heap_set_guarded_sampling((*ctx).h, GUARD_RATE, 256);
+    size_t ops = run_churn(ctx, iterations);
+    heap_set_guarded_sampling((*ctx).h, 0, 0);
+    return ops;
+}
+
+/* run_guard_latency
+----------------------
+ Allocates and frees the largest guarded blocks, which start a word past the start of their 
+ page, and small ones, with every allocation guarded and latency recording on, so each free 
+ is timed on a block that has no header in front of it. This measures the cost of one 
+ guarded sample, and it crashes if the timing path reads a header it should not.
+*/
+size_t run_guard_latency(bench_ctx* ctx, size_t iterations) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    heap_set_guarded_sampling((*ctx).h, 1, 16);
+    heap_latency_enable(true);
+    for (size_t i = 0; i < iterations; i++) {
+        char* ptr = mymalloc_ex((*ctx).h, i % 2 == 0 ? page - sizeof(void*) : 24);
+        ptr[0] = 1;
+        myfree_ex((*ctx).h, ptr);
+    }
+    heap_latency_enable(false);
+    heap_set_guarded_sampling((*ctx).h, 0, 0);
+    return iterations * 2;
+}
+
+/* run_rebuild
+----------------
+ Rebuilds the index from scratch in an empty heap, which is what a restart costs without 
+ persistence.
+*/
+size_t run_rebuild(bench_ctx* ctx, size_t iterations) {
+    for (size_t i = 0; i < iterations; i++) {
+        fresh_heap(ctx);
+        if (!build_index((*ctx).h, ctx)) {
+            fprintf(stderr, "the index did not fit in the heap\n");
+            return 1;
+        }
+    }
+    return iterations;
+}
+
+/* run_reopen
+---------------
+ Builds the index once in a file-backed heap, then closes and reopens the file, which maps 
+ it, validates the heap and looks up the root, and reads one bucket chain to show it is 
+ usable.
+*/
+size_t run_reopen(bench_ctx* ctx, size_t iterations) {
+    char path[] = "/tmp/bench_heap_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd == -1) {
+        return 1;
+    }
+    close(fd);
+    heap* h = heap_open_persistent(path, HEAP_BYTES / 2);
+    if (h == NULL || !build_index(h, ctx)) {
+        fprintf(stderr, "could not build the persistent index\n");
+        unlink(path);
+        return 1;
+    }
+
+    uint64_t sum = 0;
+    for (size_t i = 0; i < iterations && h != NULL; i++) {
+        heap_unmap(h);
+        h = heap_open_persistent(path, 0);
+        if (h != NULL) {
+            size_t* buckets = heap_get_root(h);
+            for (size_t offset = buckets[i % INDEX_BUCKETS]; offset != 0; ) {
+                index_entry* entry = heap_pointer(h, offset);
+                sum += (*entry).key;
+                offset = (*entry).next;
+            }
+        }
+    }
+    *(volatile uint64_t*)&sum = sum;
+    heap_unmap(h);
+    unlink(path);
+    return iterations;
+}
+#endif
+
+#ifndef BENCH_LIBC
+#ifdef BENCH_IMPLICIT
+#define WALK_BLOCKS (1 << 14)
+#else
+#define WALK_BLOCKS (1 << 20)
+#endif
+
+/* setup_walk
+---------------
+ Fills the heap with WALK_BLOCKS blocks of 16 to 256 bytes, about 150 MiB for the explicit
+ allocator, and frees half of them in random order. The implicit allocator gets 64 times
+ fewer blocks, since each of its allocations walks all the blocks before it.
+
+ @param ctx: the benchmark context
+*/
+void setup_walk(bench_ctx* ctx) {
+    enum { BLOCKS = WALK_BLOCKS };
+    static void* blocks[BLOCKS];
+    for (size_t i = 0; i < BLOCKS; i++) {
+        blocks[i] = mymalloc_ex((*ctx).h, 16 + next_random(ctx) % 241);
+    }
+    for (size_t i = BLOCKS - 1; i > 0; i--) {
+        size_t j = next_random(ctx) % (i + 1);
+        void* tmp = blocks[i];
+        blocks[i] = blocks[j];
+        blocks[j] = tmp;
+    }
+    for (size_t i = 0; i < BLOCKS / 2; i++) {
+        myfree_ex((*ctx).h, blocks[i]);
+    }
+}
+
+/* walk_heap
+--------------
+ Makes one allocation per iteration that cannot succeed, which walks every free block 
+ (explicit) or every block (implicit), and validates the heap, which walks every block in 
+ address order.
+
+ @param ctx: the benchmark context
+ @param iterations: the number of walks
+ @param prefetch: whether the heap prefetches ahead of its walks
+ @return: the number of walks
+*/
+size_t walk_heap(bench_ctx* ctx, size_t iterations, bool prefetch) {
+    heap_set_prefetch((*ctx).h, prefetch);
+    bool valid = true;
+    for (size_t i = 0; i < iterations; i++) {
+        void* ptr = mymalloc_ex((*ctx).h, HEAP_BYTES);
+        myfree_ex((*ctx).h, ptr);
+        valid = validate_heap_ex((*ctx).h) && valid;
+    }
+    if (!valid) {
+        fprintf(stderr, "heap failed validation\n");
+    }
+    return iterations;
+}
+
+/* run_walk
+-------------
+ Walks a heap much larger than the last-level cache without prefetching.
+*/
+size_t run_walk(bench_ctx* ctx, size_t iterations) {
+    return walk_heap(ctx, iterations, false);
+}
+
+/* run_walk_prefetch
+----------------------
+ Walks the same heap with prefetching on.
+*/
+size_t run_walk_prefetch(bench_ctx* ctx, size_t iterations) {
+    return walk_heap(ctx, iterations, true);
+}
+
+#define UTIL_HEAP_BYTES (1UL << 20)
+
+/* run_utilization
+--------------------
+ Fills a 1 MiB heap with blocks of 1 to 64 random bytes until an allocation fails, once per 
+ iteration, and prints the share of the heap that ended up holding requested bytes. The time 
+ per allocation includes the header walk, which grows with the number of blocks.
+*/
+size_t run_utilization(bench_ctx* ctx, size_t iterations) {
+    size_t allocations = 0;
+    size_t requested = 0;
+    for (size_t i = 0; i < iterations; i++) {
+        heap* h = myinit_ex((*ctx).memory, UTIL_HEAP_BYTES);
+        for (;;) {
+            size_t size = 1 + next_random(ctx) % 64;
+            char* ptr = mymalloc_ex(h, size);
+            if (ptr == NULL) {
+                break;
+            }
+            *(volatile char*)ptr = 1;
+            allocations++;
+            requested += size;
+        }
+    }
+    printf("# utilization: %.1f blocks and %.1f%% of the heap requested per fill\n",
+           (double)allocations / (double)iterations, 100.0 * (double)requested / (double)(iterations * UTIL_HEAP_BYTES));
+    return allocations;
+}
+#endif
+
+scenario scenarios[] = {
+    {"fixed", run_fixed, 1000000, NULL},
+    {"churn", run_churn, 200000, NULL},
+    {"realloc", run_realloc, 2000, NULL},
+    {"freelist", run_freelist, 500, NULL},
+    {"coalesce", run_coalesce, 200, NULL},
+    {"pingpong", run_pingpong, 500000, NULL},
+#ifndef BENCH_LIBC
+    {"utilization", run_utilization, 5, NULL},
+    {"walk", run_walk, 50, setup_walk},
+    {"walk_pf", run_walk_prefetch, 50, setup_walk},
+#endif
+#ifdef BENCH_EXPLICIT
+    {"tlb", run_tlb, 10000000, NULL},
+    {"tlb_huge", run_tlb_huge, 10000000, NULL},
+    {"rebuild", run_rebuild, 10, NULL},
+    {"reopen", run_reopen, 10, NULL},
+    {"search", search_holes, 20, setup_search},
+    {"search_tbl", search_holes, 20, setup_search_table},
+    {"frag", run_frag, 200000, NULL},
+    {"frag_cls", run_frag_classes, 200000, NULL},
+    {"counters", run_counters, 10000000, NULL},
+    {"counters_pad", run_counters_padded, 10000000, NULL},
+    {"churn_guard", run_churn_guarded, 200000, NULL},
+    {"guard_latency", run_guard_latency, 20000, NULL},
+#endif
+};
+
+// struct used to store the hardware counters opened for a scenario.
+typedef struct counters {
+    int leader; // instructions, -1 when perf events are unavailable
+    int misses; // cache misses
+    int dtlb; // dTLB load misses
+} counters;
+
+/* open_counter
+-----------------
+ Opens one hardware counter for the calling thread.
+
+ @param type: PERF_TYPE_HARDWARE or PERF_TYPE_HW_CACHE
+ @param config: the event within that type
+ @param group: the group leader, or -1 to create a new group
+ @return: the counter file descriptor, or -1 if it could not be opened
+*/
+int open_counter(uint32_t type, uint64_t config, int group) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = type;
+    attr.size = sizeof(attr);
+    attr.config = config;
+    attr.disabled = group == -1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.inherit = 0;
+    attr.read_format = PERF_FORMAT_GROUP;
+    return (int)syscall(__NR_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+/* open_counters
+------------------
+ Opens the instruction, cache-miss and dTLB-miss counters as one group. A counter the 
+ processor does not provide is left at -1 and reads as zero.
+
+ @return: the counters, with leader set to -1 if perf events are unavailable
+*/
+counters open_counters() {
+    counters c;
+    c.leader = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, -1);
+    c.misses = c.leader == -1 ? -1 : open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, c.leader);
+    uint64_t dtlb_read_miss = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    c.dtlb = c.leader == -1 ? -1 : open_counter(PERF_TYPE_HW_CACHE, dtlb_read_miss, c.leader);
+    return c;
+}
+
+/* read_counters
+------------------
+ Reads the instruction, cache-miss and dTLB-miss counts of a group.
+
+ @param c: the counters
+ @param values: receives the instruction, cache-miss and dTLB-miss counts
+ @return: true if the counts were read, false otherwise
+*/
+bool read_counters(counters c, uint64_t values[3]) {
+    uint64_t buffer[4] = {0, 0, 0, 0};
+    if (c.leader == -1 || read(c.leader, buffer, sizeof(buffer)) < (ssize_t)(2 * sizeof(uint64_t))) {
+        return false;
+    }
+    //group members follow the leader in the order they were opened, skipping failed ones
+    size_t next = 2;
+    values[0] = buffer[1];
+    values[1] = c.misses != -1 && next <= buffer[0] ? buffer[next++] : 0;
+    values[2] = c.dtlb != -1 && next <= buffer[0] ? buffer[next++] : 0;
+    return true;
+}
+
+/* now_ns
+-----------
+ @return: the monotonic clock in nanoseconds
+*/
+uint64_t now_ns() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+/* run_scenario
+-----------------
+ Runs one scenario on a fresh heap and prints its per-operation costs.
+
+ @param ctx: the benchmark context
+ @param s: the scenario
+ @param iterations: the number of iterations, or 0 for the scenario's default
+*/
+void run_scenario(bench_ctx* ctx, scenario* s, size_t iterations) {
+    fresh_heap(ctx);
+    if ((*s).setup != NULL) {
+        (*(*s).setup)(ctx);
+    }
+    counters c = open_counters();
+    if (c.leader != -1) {
+        ioctl(c.leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(c.leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+
+    uint64_t start = now_ns();
+    size_t ops = (*s).run(ctx, iterations != 0 ? iterations : (*s).iterations);
+    uint64_t elapsed = now_ns() - start;
+
+    uint64_t values[3];
+    bool counted = false;
+    if (c.leader != -1) {
+        ioctl(c.leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+        counted = read_counters(c, values);
+        close(c.leader);
+        if (c.misses != -1) {
+            close(c.misses);
+        }
+        if (c.dtlb != -1) {
+            close(c.dtlb);
+        }
+    }
+
+    if (ops == 0) {
+        //the scenario could not run here and said why
+        printf("%-10s %-10s %12s\n", ALLOCATOR_NAME, (*s).name, "skipped");
+        return;
+    }
+    printf("%-10s %-10s %12zu %10.1f", ALLOCATOR_NAME, (*s).name, ops, (double)elapsed / (double)ops);
+    if (counted) {
+        printf(" %12.1f %12.3f %12.3f\n", (double)values[0] / (double)ops, (double)values[1] / (double)ops, (double)values[2] / (double)ops);
+    } else {
+        printf(" %12s %12s %12s\n", "n/a", "n/a", "n/a");
+    }
+}
+
+int main(int argc, char* argv[]) {
+    const char* only = argc > 1 ? argv[1] : NULL;
+    size_t iterations = argc > 2 ? strtoul(argv[2], NULL, 10) : 0;
+
+    bench_ctx ctx;
+    ctx.memory = malloc(HEAP_BYTES);
+    if (ctx.memory == NULL) {
+        fprintf(stderr, "could not reserve the benchmark heap\n");
+        return 1;
+    }
+
+    printf("%-10s %-10s %12s %10s %12s %12s %12s\n", "allocator", "scenario", "ops", "ns/op", "instr/op", "misses/op", "dtlb/op");
+    bool found = false;
+    for (size_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) {
+        if (only == NULL || strcmp(only, "all") == 0 || strcmp(only, scenarios[i].name) == 0) {
+            run_scenario(&ctx, &scenarios[i], iterations);
+            found = true;
+        }
+    }
+    if (!found) {
+        fprintf(stderr, "unknown scenario %s\n", only);
+        return 1;
+    }
+
+    free(ctx.memory);
+    return 0;
+}
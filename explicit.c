@@ -3,52 +3,223 @@
  Explicit.c organizes the heap using header that contain the payload of each memory block, 
  along with a list of all free blocks. These properties make explicit.c more efficient at 
  storing memory, as well as allowing the user to quickly access free memory when it is needed. 
+
+ Building with -DSAFE_LINKING stores the free-list links mangled and checks them when they 
+ are followed (see mangle_link). Persistent and shared heaps must only be opened by builds 
+ that agree on the flag.
  */
+#define _GNU_SOURCE // pthread_getattr_np
 #include "allocator.h"
+#include "heap.h"
 #include "debug_break.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/random.h>
 #include <assert.h>
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
-// struct used to store the information of each header. 
+// struct used to store the information of each header. The free-list links are offsets 
+// (see to_link) so that the heap stays valid when its memory is mapped at another address, 
+// and they are stored mangled (see mangle_link).
 typedef struct header{
     unsigned long payload;
-    void* prev;
-    void* next;
+    unsigned long prev;
+    unsigned long next;
 } header;
 
-header* segment_start;
-header* freelist_start;
-size_t segment_size;
-void* heap_end;
-
 const unsigned long FREE_MASK = 7;
 const unsigned long PAYLOAD_MASK = ~7;
+const unsigned long TRAILER_BIT = 2; // allocated block whose payload ends with a trailer
+const unsigned long QUICK_BIT = 4; // freed block waiting on a quick list, still marked used
 
-/* myinit
----------------
- Initializes the heap memory to be managed by the allocator. The heap memory starts
- with a single free block represented by a header that contains the size of the heap
- and two NULL pointers indicating that it is not linked with other free blocks. 
+#define QUICK_MAX_SIZE 1024 // largest payload that can be deferred
+#define HUGE_PAGE_SIZE (2UL << 20)
+#define QUICK_BINS (QUICK_MAX_SIZE / ALIGNMENT + 1)
+#define HEAP_MAGIC 0x3170616568796d00ULL // identifies a heap state in a persistent file
+#define SNAPSHOT_FREE_BYTES (sizeof(header) + sizeof(purge_info)) // part of a free block kept in a snapshot
+#define SHARED_OPEN_TRIES 100000 // yields to wait for another process to finish creating a shared heap
 
- @param heap_start: pointer to the start of the heap memory to be managed
- @param heap_size: the size in bytes of the heap memory to be managed
- @return: true if the heap was initialized successfully, false otherwise
+#define HANDLE_TABLE_INITIAL 64 // entries in a heap's first handle table
+#define COMPACT_SCAN_RATIO 16 // bytes a budgeted compaction step may pass over per byte of budget
+
+// struct used to store one entry of a heap's handle table.
+typedef struct handle_entry {
+    unsigned long link; // link to the handle's block, 0 when the handle is unused
+    unsigned long pins; // pin count of a used handle, or the next unused handle
+    heap_relocate_fn relocate; // called when a relocatable block moves, NULL for plain handles
+    void* context; // passed to relocate
+} handle_entry;
+
+#define DEFRAG_SEARCH_LIMIT 64 // free-list nodes examined when looking for a hole to move a block into
+
+#define PURGE_MIN_SIZE 8192 // smallest free payload that carries a purge record
+#define PURGE_CHECK_INTERVAL 256 // frees between looks at the clock
+#define PURGE_DIRTY 0
+#define PURGE_ZEROED 1 // interior pages released with MADV_DONTNEED, they read back as zero
+#define PURGE_LAZY 2 // interior pages released with MADV_FREE, contents undefined
+
+// struct stored right after the links of a free block of at least PURGE_MIN_SIZE bytes.
+typedef struct purge_info {
+    uint64_t freed_at; // wall-clock milliseconds when the block last changed
+    unsigned long state; // PURGE_DIRTY, PURGE_ZEROED or PURGE_LAZY
+} purge_info;
+
+// struct stored in the last ALIGNMENT bytes of a sampled block's payload.
+typedef struct trailer {
+    unsigned int site; // index of the allocation site in the profile
+    unsigned int size; // size requested by the caller
+} trailer;
+
+#define PROFILE_MAX_DEPTH 32
+#define PROFILE_SITES 4096
+
+// struct used to store the samples taken at one allocation site.
+typedef struct profile_site {
+    size_t depth; // 0 when the slot is unused
+    void* frames[PROFILE_MAX_DEPTH];
+    size_t live_count;
+    size_t live_bytes;
+    size_t total_count;
+    size_t total_bytes;
+} profile_site;
+
+// struct used to store the state of a heap's sampling profiler.
+typedef struct heap_profile {
+    size_t period; // mean number of bytes between samples
+    bool sampling;
+    uint64_t rng;
+    size_t dropped; // samples not recorded because the site table was full
+    profile_site sites[PROFILE_SITES];
+} heap_profile;
+
+// struct used to remember one slot of the guarded sampling pool.
+typedef struct guard_slot {
+    size_t size; // size requested by the caller
+    bool live; // the block is allocated
+    bool used; // the slot has held a block, so its stacks are meaningful
+    size_t alloc_depth;
+    void* alloc_frames[PROFILE_MAX_DEPTH];
+    size_t free_depth;
+    void* free_frames[PROFILE_MAX_DEPTH];
+} guard_slot;
+
+// struct used to store a heap's guarded sampling pool. Each slot is one page between two 
+// inaccessible guard pages, and freed slots stay inaccessible until every other freed slot 
+// has been reused. Like the profile, it lives in process memory outside the heap.
+typedef struct guard_pool {
+    char* start; // the whole mapping, starting and ending with a guard page
+    size_t length;
+    size_t page;
+    size_t slot_count;
+    size_t unused; // slots that have never been handed out, taken from the front
+    size_t* freed; // ring of freed slots, oldest first
+    size_t freed_head;
+    size_t freed_count;
+    size_t rate; // mean number of mymalloc_ex calls per sample
+    uint64_t rng;
+    guard_slot* slots;
+    struct guard_pool* next; // next pool in guard_pools
+} guard_pool;
+
+#define PREFETCH_AHEAD 256 // bytes read ahead of a walk in address order
+#define CACHE_LINE 64 // bytes in a cache line, the unit padded blocks are placed in
+#define TABLE_INITIAL 256 // entries in a heap's first search table
+#define TABLE_MIN_PAYLOAD (ALIGNMENT * 3) // smallest free payload with room for its table slot after the links
+#define TABLE_GROUP 64 // entries summarized by one group maximum
+
+// struct used to store the dense copy of the free list that search_freelist scans when the 
+// search table is on. Like the profile, it lives in process memory outside the heap.
+typedef struct search_table {
+    size_t count;
+    size_t capacity;
+    uint32_t* units; // payload / ALIGNMENT of each entry, capped at INT32_MAX
+    unsigned long* links; // link to the free block of each entry
+    uint32_t* group_max; // largest units of each TABLE_GROUP entries, 0 for an empty group
+} search_table;
+
+// scans an array of sizes for the first one of at least the given size, see select_find_first
+typedef size_t (*find_first_fn)(const uint32_t* values, size_t count, uint32_t units);
+
+// struct used to store the state of one heap instance.
+struct heap {
+    long segment_offset; // distance from the heap state to the first block
+    unsigned long freelist_start; // link to the first free block
+    size_t segment_size;
+    unsigned long link_secret; // mixed into every link stored in a block, never a multiple of ALIGNMENT
+    heap_stats stats;
+    bool largest_free_stale; // the largest free block may have shrunk since stats.largest_free was set
+    unsigned long check_cursor; // link to the next block for validate_heap_step_ex to check
+    size_t check_interval; // calls between sampled checks, 0 when disabled
+    size_t check_budget; // blocks checked by each sampled check
+    size_t check_countdown; // calls left until the next sampled check
+    heap_corruption_handler on_corrupt;
+    long sample_countdown; // bytes left until the next sampled allocation
+    heap_profile* profile;
+    search_table* table; // dense copy of the free list for searching, NULL when off
+    guard_pool* guard; // slots for guarded samples, NULL before guarded sampling is first turned on
+    size_t guard_countdown; // mymalloc_ex calls left until the next guarded sample, 0 when not sampling
+    unsigned long quick_bins[QUICK_BINS]; // links to freed blocks waiting to be merged, one list per payload size, linked through next
+    size_t quick_max_size; // largest payload that is deferred, 0 when deferring is off
+    size_t quick_max_count; // number of deferred blocks that triggers a consolidation
+    bool mapped; // the state and segment are one mapping created by the allocator, starting at the state
+    bool map_shared; // the mapping is a shared file or shared-memory mapping
+    bool map_anonymous; // the mapping is private anonymous memory, so released pages come back zeroed
+    bool process_shared; // other processes use the heap too, every operation takes the lock
+    pthread_mutex_t lock; // robust process-shared mutex, only initialized when process_shared
+    unsigned int shared_ready; // set once a shared heap is fully initialized
+    unsigned long handle_table; // link to the block holding the handle table, 0 before the first handle
+    size_t handle_capacity; // number of entries in the handle table
+    size_t handle_free; // first unused handle, linked through the pins field, 0 when none
+    unsigned long compact_cursor; // link to the block where the next compaction step resumes, 0 for the start
+    unsigned long defrag_cursor; // link to the block where the next defragmentation step resumes, 0 for the start
+    uint64_t magic; // HEAP_MAGIC once the state is initialized
+    size_t state_size; // sizeof(heap) of the build that created the heap
+    unsigned long root; // offset of the root object from the segment start, 0 when unset
+    size_t page_align; // huge page size when the segment is huge-page backed, otherwise 0
+    bool prefetch; // walks prefetch ahead of the block they examine
+    bool size_classes; // requests up to SIZE_CLASS_MAX are rounded up to a size class
+    size_t cache_line_min; // smallest request given cache lines of its own, 0 when off
+    uint64_t purge_delay; // milliseconds a free block stays idle before its pages are released, 0 when purging is off
+    bool purge_lazy; // release with MADV_FREE instead of MADV_DONTNEED
+    size_t purge_page; // page size used to find the interior pages of a block
+    size_t purge_countdown; // frees left until the clock is checked
+    uint64_t last_purge; // time of the last purge pass
+};
+
+// heap used by the allocator.h interface (myinit/mymalloc/myfree/...)
+heap default_heap;
+
+// process-shared heap whose lock the calling thread holds, so nested calls do not lock again
+__thread heap* locked_heap;
+
+/* roundup
+------------
+ Rounds up the given size to the nearest multiple of the alignment size.
+
+ @param sz: the original size
+ @param mult: the alignment size
+ @return: the size rounded up to the nearest multiple of the alignment size
 */
-bool myinit(void *heap_start, size_t heap_size) {
-    if (heap_size < ALIGNMENT * 3) { //check for min heap_size
-        return false;
+size_t roundup(size_t sz, size_t mult) {
+    size_t corrected = (sz + mult - 1) & ~(mult - 1);
+    if (corrected < 16) {
+        return 16;
     }
-    
-    segment_size = heap_size;
-    heap_end = (char*)heap_start + heap_size;
-    segment_start = (header*)heap_start;
-    (*segment_start).payload = segment_size - ALIGNMENT;
-    (*segment_start).prev = NULL;
-    (*segment_start).next = NULL;
-    freelist_start = segment_start;
-
-    return true;
+    return corrected;
 }
 
 /* get_payload
@@ -80,339 +251,4186 @@ bool check_free(header* block) {
     return !((*block).payload & FREE_MASK);
 }
 
-/* roundup
-------------
- Rounds up the given size to the nearest multiple of the alignment size.
+/* size_class
+---------------
+ Maps a payload size to its power-of-two statistics class.
 
- @param sz: the original size
- @param mult: the alignment size
- @return: the size rounded up to the nearest multiple of the alignment size
+ @param payload: the payload size of a block
+ @return: the index of the class counting blocks of that size
 */
-size_t roundup(size_t sz, size_t mult) {
-    size_t corrected = (sz + mult - 1) & ~(mult - 1);
-    if (corrected < 16) {
-        return 16;
+size_t size_class(unsigned long payload) {
+    if (payload == 0) {
+        return 0;
     }
-    return corrected;
+    size_t class = (size_t)(63 - __builtin_clzl(payload));
+    if (class >= HEAP_STATS_CLASSES) {
+        return HEAP_STATS_CLASSES - 1;
+    }
+    return class;
 }
 
-/* search_freelist
---------------------
- Searches the list of free blocks and returns the first block that is large enough 
- to accommodate the requested size. If no suitable block is found, it returns NULL.
+#define SIZE_CLASS_COUNT 47
+#define SIZE_CLASS_MAX 65536 // largest request rounded to a size class
+#define SIZE_CLASS_LOOKUP_MAX 1024 // largest request looked up in SIZE_CLASS_LOOKUP
 
- @param request: the requested size for the block
- @return: pointer to the first free block large enough to accommodate the request, or NULL if no such block is found
-*/
-header* search_freelist(size_t request) {
-    header* curr = freelist_start;
+// payload sizes of the allocation size classes: 16 (the smallest payload roundup gives), 24 
+// and 32, then four classes per doubling, so rounding up wastes less than a quarter of a block
+const unsigned long SIZE_CLASS_SIZES[SIZE_CLASS_COUNT] = {
+    16, 24, 32, 40, 48, 56, 64, 80,
+    96, 112, 128, 160, 192, 224, 256, 320,
+    384, 448, 512, 640, 768, 896, 1024, 1280,
+    1536, 1792, 2048, 2560, 3072, 3584, 4096, 5120,
+    6144, 7168, 8192, 10240, 12288, 14336, 16384, 20480,
+    24576, 28672, 32768, 40960, 49152, 57344, 65536,
+};
 
-    while(curr != NULL) {
-        bool free = check_free(curr);
-        if (free && get_payload(curr) >= request) {
-            return curr;
-        }
-        curr = (header*)(*curr).next;
+// class of each request up to SIZE_CLASS_LOOKUP_MAX, indexed by the request in 8-byte granules 
+// rounded up; generated from SIZE_CLASS_SIZES
+const unsigned char SIZE_CLASS_LOOKUP[SIZE_CLASS_LOOKUP_MAX / 8 + 1] = {
+    0, 0, 0, 1, 2, 3, 4, 5, 6, 7, 7, 8, 8, 9, 9, 10,
+    10, 11, 11, 11, 11, 12, 12, 12, 12, 13, 13, 13, 13, 14, 14, 14,
+    14, 15, 15, 15, 15, 15, 15, 15, 15, 16, 16, 16, 16, 16, 16, 16,
+    16, 17, 17, 17, 17, 17, 17, 17, 17, 18, 18, 18, 18, 18, 18, 18,
+    18, 19, 19, 19, 19, 19, 19, 19, 19, 19, 19, 19, 19, 19, 19, 19,
+    19, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20, 20,
+    20, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21, 21,
+    21, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22, 22,
+    22,
+};
+
+/* request_class
+------------------
+ Maps a request to the smallest size class that holds it in constant time: a table lookup 
+ for small requests, and above that the position of the highest set bit picks the doubling 
+ and the next two bits pick the quarter within it.
+
+ @param size: the requested size, from 1 to SIZE_CLASS_MAX
+ @return: the index of the class in SIZE_CLASS_SIZES
+*/
+size_t request_class(size_t size) {
+    if (size <= SIZE_CLASS_LOOKUP_MAX) {
+        return SIZE_CLASS_LOOKUP[(size + 7) >> 3];
     }
+    size_t bit = (size_t)(63 - __builtin_clzl(size - 1)); //2^bit < size <= 2^(bit + 1)
+    return 4 * (bit - 4) - 1 + ((size - 1 - (1UL << bit)) >> (bit - 2));
+}
 
-    return NULL;
+/* cache_padded
+-----------------
+ Checks whether a request is placed in cache lines of its own.
+
+ @param h: the heap the request is made to
+ @param size: the requested size in bytes
+ @return: true if the request is padded to whole cache lines
+*/
+bool cache_padded(heap* h, size_t size) {
+    return (*h).cache_line_min != 0 && size >= (*h).cache_line_min && size <= MAX_REQUEST_SIZE;
 }
 
-/* remove_freelist
---------------------
- Removes a block from the list of free blocks. This is typically used when a free 
- block is allocated and is no longer available for use.
+/* round_request
+------------------
+ Rounds a request up to the payload size that is allocated for it. A padded request ends 
+ one header short of a cache line boundary, so the block after it starts its payload on a 
+ new line. Otherwise the request gets its size class when the heap uses size classes, or 
+ the next multiple of ALIGNMENT.
 
- @param new: pointer to the block to be removed from the free list
+ @param h: the heap the request is made to
+ @param size: the requested size in bytes
+ @return: the payload size to allocate
 */
-void remove_freelist(header* new) {
-    header curr = *new;
+size_t round_request(heap* h, size_t size) {
+    if (cache_padded(h, size)) {
+        return roundup(size + ALIGNMENT, CACHE_LINE) - ALIGNMENT;
+    }
+    if ((*h).size_classes && size != 0 && size <= SIZE_CLASS_MAX) {
+        return SIZE_CLASS_SIZES[request_class(size)];
+    }
+    return roundup(size, ALIGNMENT);
+}
 
-    if (curr.prev == NULL) { //first element in linked list
+/* stats_count
+---------------
+ Adds or removes a block from the heap statistics. Every change to a block's size or 
+ free/used status is recorded as removing the old block and adding the new one.
 
-        if (curr.next == NULL) { //only elememnt case
-            freelist_start = NULL;
-            return;
-        }
- 
-        header* new_front = (header*)curr.next;
-        freelist_start = new_front;
-        (*new_front).prev = NULL;
+ @param h: the heap whose statistics are updated
+ @param payload: the payload size of the block
+ @param free: whether the block is free
+ @param delta: 1 if the block is being added, -1 if it is being removed
+*/
+void stats_count(heap* h, unsigned long payload, bool free, int delta) {
+    heap_stats* stats = &(*h).stats;
+    size_t class = size_class(payload);
+
+    if (!free) {
+        (*stats).bytes_allocated += delta * (long)payload;
+        (*stats).blocks_allocated += delta;
+        (*stats).allocated_per_class[class] += delta;
         return;
     }
-    
-    header* next_header = (header*)(curr.next);
-    header* prev_header = (header*)(curr.prev);
 
-    if (next_header != NULL) {
-        (*next_header).prev = (void*)prev_header;
-    }
-    if (prev_header != NULL) {
-        (*prev_header).next = (void*)next_header;
+    (*stats).bytes_free += delta * (long)payload;
+    (*stats).blocks_free += delta;
+    (*stats).free_per_class[class] += delta;
+    (*stats).freelist_length += delta;
+    if (delta > 0 && payload > (*stats).largest_free) {
+        (*stats).largest_free = payload;
+        (*h).largest_free_stale = false;
+    } else if (delta < 0 && payload == (*stats).largest_free) {
+        (*h).largest_free_stale = true;
     }
 }
 
-/* get_next_block
--------------------
- Retrieves the block that comes after a given block in memory.
+/* get_segment_start
+----------------------
+ @param h: the heap
+ @return: pointer to the first block of the heap's segment
+*/
+header* get_segment_start(heap* h) {
+    return (header*)((char*)h + (*h).segment_offset);
+}
 
- @param block: pointer to the block
- @return: pointer to the next block in memory, or NULL if the given block is the last one in memory
+/* get_heap_end
+-----------------
+ @param h: the heap
+ @return: pointer just past the last block of the heap's segment
 */
-header* get_next_block(header* block) {
-    unsigned long payload_val = get_payload(block);
-    char* next_location = (char*)block + payload_val + ALIGNMENT;
-    if ((void*)next_location == heap_end) {
-        return NULL;
-    } 
-    return (header*)next_location;
+void* get_heap_end(heap* h) {
+    return (char*)get_segment_start(h) + (*h).segment_size;
 }
 
-/* coalesce
--------------
- Combines a block with the next block in memory if the next block is free, effectively 
- creating a larger free block. This helps in reducing fragmentation and making larger 
- chunks of memory available for allocation.
+/* to_link
+------------
+ Encodes a block as a link: the offset of its payload from the start of the segment. 
+ Links stay valid wherever the heap is mapped, and 0 never names a block.
 
- @param block: pointer to the block to be coalesced with the next block
+ @param h: the heap containing the block
+ @param block: pointer to the block, or NULL
+ @return: the link to the block, or 0 for NULL
 */
-void coalesce(header* block) {
-    header* next_block = get_next_block(block);
-    bool free = check_free(next_block);
-
-    if (next_block == NULL || !free) {
-        return;
+unsigned long to_link(heap* h, header* block) {
+    if (block == NULL) {
+        return 0;
     }
-    
-    unsigned long next_payload_val = get_payload(next_block);
-    unsigned long added_space = next_payload_val + ALIGNMENT;
-    remove_freelist(next_block);
-    (*block).payload += added_space;
-    
+    return (unsigned long)((char*)block - (char*)get_segment_start(h)) + ALIGNMENT;
 }
 
-/* add_freelist
--------------------
- Adds a block to the free list. This typically happens when a block is freed or when 
- a large block is split into two smaller blocks.
+/* from_link
+--------------
+ Decodes a link made by to_link.
 
- @param new: pointer to the block to be added to the free list
+ @param h: the heap containing the block
+ @param link: the link
+ @return: pointer to the linked block, or NULL if the link is 0
 */
-void add_freelist(header* new) {
-    if (freelist_start == NULL) {
-        freelist_start = new;
-        (*new).prev = NULL;
-        (*new).next = NULL;
-        return;
+header* from_link(heap* h, unsigned long link) {
+    if (link == 0) {
+        return NULL;
     }
-
-    (*freelist_start).prev = (void*)new;
-    (*new).next = (void*)freelist_start;
-    (*new).prev = NULL;
-    freelist_start = new;
+    return (header*)((char*)get_segment_start(h) + link - ALIGNMENT);
 }
 
-/* add_block
---------------
- Splits a block into two: one of the requested size and the other containing the remaining space. 
+/* new_link_secret
+--------------------
+ Draws the secret a heap mixes into its stored links, from the kernel's random source or, 
+ failing that, from the clock and the heap's address. The low bits are never all clear, 
+ so an aligned value written over a link decodes to a misaligned one.
 
- @param block: pointer to the block to be split
- @param request: the requested size for the new block
+ @param h: the heap the secret is for
+ @return: the secret
 */
-void add_block(header* block, size_t request) {
-    bool free = check_free(block);
-    char* location = (char*)block;
-    unsigned long payload_val = get_payload(block);   
-    (*block).payload = request + 1;
-    header* new = (header*)(location + request + ALIGNMENT);
-    (*new).payload = payload_val - request - ALIGNMENT;
-    if (free) {
-        remove_freelist(block);
+unsigned long new_link_secret(heap* h) {
+    unsigned long secret = 0;
+    if (getrandom(&secret, sizeof(secret), GRND_NONBLOCK) != (ssize_t)sizeof(secret)) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        secret = ((unsigned long)(uintptr_t)h ^ (unsigned long)now.tv_nsec ^ ((unsigned long)now.tv_sec << 32))
+            * 0x9E3779B97F4A7C15UL;
     }
-    add_freelist(new);
-    coalesce(new);
+    return secret | 1;
 }
 
-/* coalesce_multiple_blocks
------------------------------
- Continuously merges a block with its subsequent free blocks until it has enough space 
- to accommodate the specified size.
+/* mangle_link
+----------------
+ Encodes or decodes a link stored in a block (safe-linking). The link is XORed with the 
+ heap's secret and with the position of the word holding it, so a stray or hostile write 
+ to a free block's links decodes to an unpredictable, most likely misaligned offset rather 
+ than one chosen by the writer. The position is taken relative to the segment, so a heap 
+ mapped at another address decodes the same way. Mangling twice gives back the link. 
+ Without SAFE_LINKING, links are stored as they are.
 
- @param block: pointer to the block to be coalesced with subsequent free blocks
- @param req: the requested size that the block should be able to accommodate after coalescing
+ @param h: the heap containing the word
+ @param slot: the word the link is stored in
+ @param value: the link to encode, or the stored word to decode
+ @return: the stored word, or the decoded link
 */
-void coalesce_multiple_blocks(header* block, unsigned long req) {
-    header* next_block = get_next_block(block); //coalesce right block while it is free
-    while (check_free(next_block) && get_payload(block) < req) {
-        coalesce(block);
-        next_block = get_next_block(block);
-    }
+unsigned long mangle_link(heap* h, unsigned long* slot, unsigned long value) {
+#ifdef SAFE_LINKING
+    return value ^ (*h).link_secret ^ (unsigned long)((char*)slot - (char*)get_segment_start(h));
+#else
+    (void)h;
+    (void)slot;
+    return value;
+#endif
 }
 
-/* mymalloc
--------------
- Allocates a block of memory of the specified size from the heap. It does this by searching 
- the free block list for a suitable block. If a suitable block is found, it is removed from 
- the free list and returned to the caller.
+/* read_link
+--------------
+ Decodes a stored link without checking it, for the validators that check it themselves.
 
- @param requested_size: the size in bytes of the block to be allocated
- @return: a pointer to the allocated block, or NULL if allocation failed
+ @param h: the heap containing the word
+ @param slot: the word holding the link
+ @return: the decoded link
 */
-void *mymalloc(size_t requested_size) {
-    size_t request = roundup(requested_size, ALIGNMENT);  
-    header* free_location = search_freelist(request); 
+unsigned long read_link(heap* h, unsigned long* slot) {
+    return mangle_link(h, slot, *slot);
+}
 
-    if (free_location == NULL) { //no available blocks 
-        return NULL;
-    }
-    if (request > MAX_REQUEST_SIZE) {
-        return NULL;
-    }
+/* store_link
+---------------
+ Stores a link in a block, mangled.
 
-    unsigned long payload_val = get_payload(free_location);
-    char* location = (char*)free_location;
+ @param h: the heap containing the word
+ @param slot: the word to store the link in
+ @param link: the link to store, 0 for none
+*/
+void store_link(heap* h, unsigned long* slot, unsigned long link) {
+    *slot = mangle_link(h, slot, link);
+}
 
-    if (location + payload_val + ALIGNMENT == heap_end) {//last block and add new header special case
+/* in_segment
+---------------
+ Determines whether a free-list link points at a plausible block of the heap.
 
-        if (payload_val >= request + (ALIGNMENT * 3)) {
-            add_block(free_location, request);
-            return (void*)(location + ALIGNMENT);
-        }
-        
+ @param h: the heap
+ @param link: a link taken from a free block or the heap state
+ @return: true if the link is 0 or names an aligned offset inside the segment, false otherwise
+*/
+bool in_segment(heap* h, unsigned long link) {
+    if (link == 0) {
+        return true;
     }
-
-    (*free_location).payload += 1; //update the free block
-    remove_freelist(free_location);
-    return (void*)(location + ALIGNMENT);     
+    return link - ALIGNMENT < (*h).segment_size && (link % ALIGNMENT) == 0;
 }
 
-/* myfree
------------
- Frees a block of memory, making it available for future allocations. The block is added 
- back to the free list and coalesced with any adjacent free blocks.
+/* link_corrupt
+-----------------
+ Reports a free-list link that failed its checks, through the heap's corruption handler 
+ when one is set, and aborts. Unlike sampled_check it does not return even when the 
+ handler does, since the caller would go on to hand out or relink a block still on the 
+ free list.
 
- @param ptr: pointer to the block to be freed
+ @param h: the heap
+ @param block: the block whose link, or whose neighbour's link, is damaged
 */
-void myfree(void *ptr) {
-    if (ptr == NULL) {
-        return;
+__attribute__((noinline, cold, noreturn)) void link_corrupt(heap* h, header* block) {
+    if ((*h).on_corrupt != NULL) {
+        (*h).on_corrupt(h, (void*)block);
     }
-
-    header* block = (header*)((char*)ptr - ALIGNMENT);
-    (*block).payload -= 1;
-    add_freelist(block);
-    coalesce(block);   
+    fprintf(stderr, "heap %p: corrupted free-list link at %p\n", (void*)h, (void*)block);
+    abort();
 }
 
-/* myrealloc
+/* load_link
 --------------
- Resizes an allocated block to a new size. If the block is large enough to accommodate the 
- new size, it is split into two: one of the new size and the other containing the remaining 
- space. If the block is not large enough, a new block of the requested size is allocated, 
- the contents of the old block are copied to the new block, and the old block is freed.
+ Decodes a link stored in a block and checks that it names an aligned offset inside the 
+ segment. A damaged link is reported and aborts. Without SAFE_LINKING, the link is 
+ returned unchecked.
 
- @param old_ptr: the pointer to the block to be reallocated
- @param new_size: the new size for the block
- @return: a pointer to the newly allocated block, or NULL if reallocation failed
+ @param h: the heap containing the word
+ @param block: the block holding the word
+ @param slot: the word holding the link
+ @return: the decoded link
 */
-void *myrealloc(void *old_ptr, size_t new_size) {
-    if (old_ptr == NULL) {
-        return mymalloc(new_size);
+unsigned long load_link(heap* h, header* block, unsigned long* slot) {
+#ifdef SAFE_LINKING
+    unsigned long link = mangle_link(h, slot, *slot);
+    if (!in_segment(h, link)) {
+        link_corrupt(h, block);
     }
+    return link;
+#else
+    (void)h;
+    (void)block;
+    return *slot;
+#endif
+}
 
-    unsigned long request = roundup(new_size, ALIGNMENT);
-    header* old_header = (header*)((char*)old_ptr - ALIGNMENT);
-    unsigned long old_size = get_payload(old_header);
+/* next_free
+--------------
+ Follows the next link of a free block, or of a deferred block on a quick list.
 
-    if (new_size == 0) { //realloc(0) case
-        myfree(old_ptr);
-        return NULL; 
-    }
+ @param h: the heap containing the block
+ @param block: the block
+ @return: the next block on the list, or NULL at its end
+*/
+header* next_free(heap* h, header* block) {
+    return from_link(h, load_link(h, block, &(*block).next));
+}
 
-    coalesce_multiple_blocks(old_header, request); //coalsce until enough space or right block occupied
+/* now_ms
+-----------
+ The times kept in purge records and in the heap state are saved with persistent heaps and 
+ compared across processes of shared heaps, so they come from the wall clock. The 
+ monotonic clock restarts at boot and would make reloaded times meaningless. A clock step 
+ only delays or hastens a purge.
 
-    if (get_payload(old_header) >= request) { //in place realloc
-        void* block_end = (void*)(get_payload(old_header) + (char*)old_ptr);
+ @return: the wall clock in milliseconds, read from the cheap coarse clock when available
+*/
+uint64_t now_ms() {
+    struct timespec now;
+#ifdef CLOCK_REALTIME_COARSE
+    clock_gettime(CLOCK_REALTIME_COARSE, &now);
+#else
+    clock_gettime(CLOCK_REALTIME, &now);
+#endif
+    return (uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000;
+}
 
-        if (block_end == heap_end && request + (ALIGNMENT * 3) < get_payload(old_header)) {
-            header* new = (header*)((char*)old_ptr + request); 
-            (*new).payload = get_payload(old_header) - request - ALIGNMENT;
-            (*old_header).payload = request + 1;
-            add_freelist(new);
-        } //last block on the heap, prevents heap exhuastion 
+/* get_purge_info
+-------------------
+ Finds the purge record of a free block. Only large blocks have one, and only while 
+ purging is enabled; otherwise those bytes are ordinary payload.
 
-        if (block_end != heap_end && old_size >= request + (ALIGNMENT * 3)) {  
-            add_block(old_header, request);
-        }
-        
-        return old_ptr;
+ @param h: the heap containing the block
+ @param block: pointer to the block
+ @return: pointer to the block's purge record, or NULL if it has none
+*/
+purge_info* get_purge_info(heap* h, header* block) {
+    if ((*h).purge_delay == 0 || get_payload(block) < PURGE_MIN_SIZE) {
+        return NULL;
     }
-    
-    void* new_ptr = mymalloc(new_size);
-    void* check = memcpy(new_ptr, old_ptr, old_size);
-    assert(check != NULL);
-    myfree(old_ptr);
-    return new_ptr;
+    return (purge_info*)((char*)block + sizeof(header));
 }
 
-/* validate_heap
-------------------
- Validates the state of the heap. It checks whether the blocks are correctly aligned, 
- whether the total size of the blocks matches the size of the heap, whether there are 
- any overlapping blocks, and whether the free list correctly contains all the free blocks.
+/* stamp_free
+---------------
+ Records that a free block has just been created or resized, restarting its idle time. 
+ Its pages may have been written to, so it no longer counts as purged.
 
- @return: true if the heap is valid, false otherwise
+ @param h: the heap containing the block
+ @param block: pointer to the free block
 */
-bool validate_heap() {
-    char* index = (char*)segment_start;
-    header* block = segment_start;
-    unsigned long total_heap_used = 0;
-    while ((void*)index != heap_end) {
-        unsigned long payload_val = get_payload(block);
-        if (index > (char*)heap_end) {
-            return false; //block goes outside heap segment
-        }
-        if ((payload_val % ALIGNMENT) != 0) {
-            return false;
-        }
- 
-        total_heap_used += payload_val + ALIGNMENT;
-        index += payload_val + ALIGNMENT;
-        block = (header*)index;
+void stamp_free(heap* h, header* block) {
+    purge_info* info = get_purge_info(h, block);
+    if (info != NULL) {
+        (*info).freed_at = now_ms();
+        (*info).state = PURGE_DIRTY;
     }
+}
 
-    if (total_heap_used != segment_size) {
-        return false;
-    }
+/* init_segment
+---------------
+ Initializes the heap memory to be managed by the allocator. The heap memory starts
+ with a single free block represented by a header that contains the size of the heap
+ and two empty links indicating that it is not linked with other free blocks. 
 
-    header* curr = freelist_start;
+ @param h: the heap whose state is initialized
+ @param heap_start: pointer to the start of the heap memory to be managed
+ @param heap_size: the size in bytes of the heap memory to be managed
+ @return: true if the heap was initialized successfully, false otherwise
+*/
+bool init_segment(heap* h, void *heap_start, size_t heap_size) {
+    if (heap_size < ALIGNMENT * 3) { //check for min heap_size
+        return false;
+    }
+    
+    (*h).segment_size = heap_size;
+    (*h).segment_offset = (long)((char*)heap_start - (char*)h);
+    (*h).link_secret = new_link_secret(h);
+    header* segment_start = get_segment_start(h);
+    (*segment_start).payload = heap_size - ALIGNMENT;
+    store_link(h, &(*segment_start).prev, 0);
+    store_link(h, &(*segment_start).next, 0);
+    (*h).freelist_start = to_link(h, segment_start);
+
+    memset(&(*h).stats, 0, sizeof(heap_stats));
+    (*h).largest_free_stale = false;
+    stats_count(h, get_payload(segment_start), true, 1);
+
+    (*h).check_cursor = to_link(h, segment_start);
+    (*h).check_interval = 0;
+    (*h).check_budget = 0;
+    (*h).check_countdown = 0;
+    (*h).on_corrupt = NULL;
+    (*h).sample_countdown = LONG_MAX;
+    (*h).profile = NULL;
+    (*h).table = NULL;
+    (*h).guard = NULL;
+    (*h).guard_countdown = 0;
+    memset((*h).quick_bins, 0, sizeof((*h).quick_bins));
+    (*h).quick_max_size = 0;
+    (*h).quick_max_count = 0;
+    (*h).mapped = false;
+    (*h).map_shared = false;
+    (*h).map_anonymous = false;
+    (*h).process_shared = false;
+    (*h).magic = HEAP_MAGIC;
+    (*h).state_size = sizeof(heap);
+    (*h).root = 0;
+    (*h).handle_table = 0;
+    (*h).handle_capacity = 0;
+    (*h).handle_free = 0;
+    (*h).compact_cursor = 0;
+    (*h).defrag_cursor = 0;
+    (*h).page_align = 0;
+    (*h).prefetch = false;
+    (*h).size_classes = false;
+    (*h).cache_line_min = 0;
+    (*h).purge_delay = 0;
+    (*h).purge_lazy = false;
+    (*h).purge_page = 0;
+    (*h).purge_countdown = 0;
+    (*h).last_purge = 0;
+
+    return true;
+}
+
+/* myinit_ex
+---------------
+ Creates an independent heap in the given memory. The heap state is stored at the 
+ start of the memory and the rest is managed as the heap segment, so the returned 
+ handle stays valid for as long as the memory does.
+
+ @param heap_start: pointer to the start of the memory to be managed
+ @param heap_size: the size in bytes of the memory to be managed
+ @return: a handle to the new heap, or NULL if the memory is too small
+*/
+heap* myinit_ex(void *heap_start, size_t heap_size) {
+    size_t state_size = roundup(sizeof(heap), ALIGNMENT);
+    if (heap_size < state_size) {
+        return NULL;
+    }
+
+    heap* h = (heap*)heap_start;
+    if (!init_segment(h, (char*)heap_start + state_size, heap_size - state_size)) {
+        return NULL;
+    }
+    return h;
+}
+
+/* myinit_mapped
+---------------
+ Maps fresh anonymous memory and creates a heap in it. With HEAP_MAP_HUGE the mapping is 
+ made of 2 MiB pages: MAP_HUGETLB is tried first, and if no huge pages are reserved the 
+ mapping is aligned to 2 MiB by hand and handed to transparent huge pages instead.
+
+ @param heap_size: the size in bytes of the memory to map
+ @param flags: HEAP_MAP_HUGE for huge-page backing, otherwise 0
+ @return: a handle to the new heap, or NULL if the memory could not be mapped
+*/
+heap* myinit_mapped(size_t heap_size, int flags) {
+    bool huge = (flags & HEAP_MAP_HUGE) != 0;
+    size_t page = huge ? HUGE_PAGE_SIZE : (size_t)sysconf(_SC_PAGESIZE);
+    size_t length = roundup(heap_size, page);
+    char* base = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+    if (huge) {
+        base = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+#endif
+    if (base == MAP_FAILED) {
+        char* reserved = mmap(NULL, length + page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (reserved == MAP_FAILED) {
+            return NULL;
+        }
+        base = (char*)roundup((size_t)reserved, page); //trim the reservation to an aligned mapping
+        if (base != reserved) {
+            munmap(reserved, (size_t)(base - reserved));
+        }
+        munmap(base + length, (size_t)(reserved + page - base));
+#ifdef MADV_HUGEPAGE
+        if (huge) {
+            madvise(base, length, MADV_HUGEPAGE);
+        }
+#endif
+    }
+
+    heap* h = myinit_ex(base, length);
+    if (h == NULL) {
+        munmap(base, length);
+        return NULL;
+    }
+    (*h).mapped = true;
+    (*h).map_anonymous = true;
+    (*h).page_align = huge ? HUGE_PAGE_SIZE : 0;
+    return h;
+}
+
+/* check_mapped_state
+-------------------------
+ Checks that a mapping made by another process (or an earlier run) starts with the state 
+ of a heap built the same way as this one and spanning the whole mapping.
+
+ @param h: the start of the mapping
+ @param length: the size in bytes of the mapping
+ @return: true if the mapping holds a compatible heap, false otherwise
+*/
+bool check_mapped_state(heap* h, size_t length) {
+    size_t state_size = roundup(sizeof(heap), ALIGNMENT);
+    return length >= state_size && (*h).magic == HEAP_MAGIC && (*h).state_size == sizeof(heap)
+        && (*h).segment_offset == (long)state_size && (*h).segment_size == length - state_size;
+}
+
+/* forget_relocations
+-----------------------
+ Relocation callbacks are addresses in the process that registered them. When a heap is 
+ opened by another process, its relocatable blocks are pinned for good instead, since 
+ nobody could be told that they moved.
+
+ @param h: the heap
+*/
+void forget_relocations(heap* h) {
+    if ((*h).handle_table == 0) {
+        return;
+    }
+    handle_entry* table = (handle_entry*)((char*)from_link(h, (*h).handle_table) + ALIGNMENT);
+    for (size_t i = 0; i < (*h).handle_capacity; i++) {
+        if (table[i].link != 0 && table[i].relocate != NULL) {
+            table[i].relocate = NULL;
+            table[i].context = NULL;
+            table[i].pins = 1;
+        }
+    }
+}
+
+/* heap_open_persistent
+-------------------------
+ Opens a heap stored in a file. A missing or empty file is created with the given size 
+ and holds a new, empty heap. An existing file is mapped as it is, wherever the system 
+ places it; since the allocator keeps only offsets inside the heap, its blocks can be used 
+ straight away. The heap is validated before it is handed out. State that only made sense 
+ in the process that wrote the file (the profiler, corruption handler and latency timing) 
+ starts over.
+
+ @param path: the file holding the heap
+ @param heap_size: the size in bytes of a newly created file, ignored for an existing one
+ @return: a handle to the heap, or NULL if the file could not be mapped or holds no valid heap
+*/
+heap* heap_open_persistent(const char* path, size_t heap_size) {
+    int fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (fd == -1) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return NULL;
+    }
+    bool fresh = st.st_size == 0;
+    size_t length = fresh ? roundup(heap_size, (size_t)sysconf(_SC_PAGESIZE)) : (size_t)st.st_size;
+    if (fresh && ftruncate(fd, (off_t)length) != 0) {
+        close(fd);
+        return NULL;
+    }
+    char* base = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        return NULL;
+    }
+
+    heap* h = fresh ? myinit_ex(base, length) : (heap*)base;
+    if (h == NULL || (!fresh && !check_mapped_state(h, length)) || (*h).process_shared) {
+        munmap(base, length);
+        return NULL;
+    }
+
+    (*h).profile = NULL;
+    (*h).table = NULL;
+    (*h).guard = NULL;
+    (*h).guard_countdown = 0;
+    (*h).on_corrupt = NULL;
+    (*h).sample_countdown = LONG_MAX;
+    (*h).mapped = true;
+    (*h).map_shared = true;
+    (*h).page_align = 0;
+    if (!fresh && !validate_heap_ex(h)) { //the writer may have died in the middle of an operation
+        munmap(base, length);
+        return NULL;
+    }
+    forget_relocations(h);
+    return h;
+}
+
+/* heap_open_shared
+---------------------
+ Opens a heap in a POSIX shared memory object so several processes can allocate from it 
+ and free each other's blocks. The first process to open the name creates the object with 
+ the given size and initializes the heap; later ones wait for that to finish and attach to 
+ it at whatever address their mapping gets. Every operation holds a robust process-shared 
+ mutex. Blocks are handed between processes as heap_offset() values.
+
+ @param name: the shared memory object name, starting with a slash
+ @param heap_size: the size in bytes of the heap when it is created, ignored otherwise
+ @return: a handle to the heap in this process, or NULL if it could not be opened
+*/
+heap* heap_open_shared(const char* name, size_t heap_size) {
+    size_t length = roundup(heap_size, (size_t)sysconf(_SC_PAGESIZE));
+    bool creator = true;
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd == -1 && errno == EEXIST) {
+        creator = false;
+        fd = shm_open(name, O_RDWR, 0600);
+    }
+    if (fd == -1) {
+        return NULL;
+    }
+
+    if (creator && ftruncate(fd, (off_t)length) != 0) {
+        close(fd);
+        shm_unlink(name);
+        return NULL;
+    }
+    struct stat st;
+    for (int tries = 0; !creator; tries++) { //the creator may not have sized the object yet
+        if (fstat(fd, &st) != 0 || tries == SHARED_OPEN_TRIES) {
+            close(fd);
+            return NULL;
+        }
+        if (st.st_size != 0) {
+            length = (size_t)st.st_size;
+            break;
+        }
+        sched_yield();
+    }
+    char* base = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        return NULL;
+    }
+
+    heap* h = (heap*)base;
+    if (creator) {
+        pthread_mutexattr_t attr;
+        h = myinit_ex(base, length);
+        if (h == NULL || pthread_mutexattr_init(&attr) != 0) {
+            munmap(base, length);
+            shm_unlink(name);
+            return NULL;
+        }
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+        pthread_mutex_init(&(*h).lock, &attr);
+        pthread_mutexattr_destroy(&attr);
+        (*h).mapped = true;
+        (*h).map_shared = true;
+        (*h).process_shared = true;
+        __atomic_store_n(&(*h).shared_ready, 1, __ATOMIC_RELEASE);
+        return h;
+    }
+
+    for (int tries = 0; __atomic_load_n(&(*h).shared_ready, __ATOMIC_ACQUIRE) == 0; tries++) {
+        if (tries == SHARED_OPEN_TRIES) {
+            munmap(base, length);
+            return NULL;
+        }
+        sched_yield();
+    }
+    if (!check_mapped_state(h, length) || !(*h).process_shared) {
+        munmap(base, length);
+        return NULL;
+    }
+    return h;
+}
+
+/* shared_lock
+----------------
+ Takes the lock of a process-shared heap. If the previous owner died while holding it, the 
+ heap is validated: when it is intact the lock is recovered, otherwise the lock is left 
+ unrecoverable and every later operation on the heap fails.
+
+ @param h: the heap
+ @return: true if the lock is held, false if the heap can no longer be used
+*/
+bool shared_lock(heap* h) {
+    int result = pthread_mutex_lock(&(*h).lock);
+    if (result == EOWNERDEAD) {
+        locked_heap = h;
+        bool intact = validate_heap_ex(h);
+        locked_heap = NULL;
+        if (!intact) {
+            fprintf(stderr, "shared heap %p was left damaged by a dead process\n", (void*)h);
+            pthread_mutex_unlock(&(*h).lock);
+            return false;
+        }
+        pthread_mutex_consistent(&(*h).lock);
+        result = 0;
+    }
+    if (result != 0) {
+        return false;
+    }
+    locked_heap = h;
+    return true;
+}
+
+/* shared_unlock
+------------------
+ Releases the lock taken by shared_lock.
+
+ @param h: the heap
+*/
+void shared_unlock(heap* h) {
+    locked_heap = NULL;
+    pthread_mutex_unlock(&(*h).lock);
+}
+
+/* needs_lock
+---------------
+ @param h: the heap
+ @return: true if the heap is process-shared and the calling thread does not hold its lock yet
+*/
+bool needs_lock(heap* h) {
+    return (*h).process_shared && locked_heap != h;
+}
+
+// guarded pools of every heap in the process, searched by the fault handler
+guard_pool* guard_pools;
+pthread_mutex_t guard_pools_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* guard_release
+------------------
+ Unmaps a heap's guarded sampling pool and drops it from the list the fault handler 
+ searches. Blocks still allocated from the pool become invalid.
+
+ @param h: the heap whose pool is released
+*/
+void guard_release(heap* h) {
+    guard_pool* pool = (*h).guard;
+    if (pool == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&guard_pools_lock);
+    guard_pool** link = &guard_pools;
+    while (*link != pool) {
+        link = &(**link).next;
+    }
+    __atomic_store_n(link, (*pool).next, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&guard_pools_lock);
+
+    munmap((*pool).start, (*pool).length);
+    free((*pool).freed);
+    free((*pool).slots);
+    free(pool);
+    (*h).guard = NULL;
+    (*h).guard_countdown = 0;
+}
+
+/* heap_unmap
+---------------
+ Releases a heap created by myinit_mapped, heap_open_persistent or heap_restore, along with 
+ its profiler tables, or detaches this process from a heap opened with heap_open_shared. A persistent 
+ heap is written back to its file first.
+
+ @param h: the heap to release
+*/
+void heap_unmap(heap* h) {
+    if (h == NULL || !(*h).mapped) {
+        return;
+    }
+    size_t length = (size_t)(*h).segment_offset + (*h).segment_size;
+    if (!(*h).process_shared) {
+        free((*h).profile);
+        heap_set_search_table(h, false);
+        guard_release(h);
+    }
+    if ((*h).map_shared) {
+        msync(h, length, MS_SYNC);
+    }
+    munmap(h, length);
+}
+
+/* write_range
+-----------------
+ Writes a range of memory to a file at the given position, retrying short writes.
+
+ @param fd: the file
+ @param data: the memory to write
+ @param length: the number of bytes to write
+ @param offset: the file position to write at
+ @return: true if everything was written, false otherwise
+*/
+bool write_range(int fd, const char* data, size_t length, off_t offset) {
+    while (length > 0) {
+        ssize_t written = pwrite(fd, data, length, offset);
+        if (written <= 0) {
+            return false;
+        }
+        data += written;
+        length -= (size_t)written;
+        offset += written;
+    }
+    return true;
+}
+
+/* heap_snapshot
+------------------
+ Writes an image of the heap to a file: a copy of its state followed by the segment. Only 
+ the header, links and purge record of a free block are written; the rest of the block is 
+ skipped, so it becomes a hole in the sparse file and costs no disk space. The image has 
+ the layout of a heap from heap_open_persistent, whichever way the heap was created.
+
+ @param h: the heap to capture
+ @param path: the file to write, replaced if it exists
+ @return: true if the snapshot was written, false otherwise
+*/
+bool heap_snapshot(heap* h, const char* path) {
+    if (needs_lock(h)) {
+        if (!shared_lock(h)) {
+            return false;
+        }
+        bool result = heap_snapshot(h, path);
+        shared_unlock(h);
+        return result;
+    }
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd == -1) {
+        return false;
+    }
+
+    size_t state_size = roundup(sizeof(heap), ALIGNMENT);
+    heap state = *h; //process-local parts of the state do not carry over
+    state.segment_offset = (long)state_size;
+    state.profile = NULL;
+    state.table = NULL;
+    state.guard = NULL;
+    state.guard_countdown = 0;
+    state.on_corrupt = NULL;
+    state.sample_countdown = LONG_MAX;
+    state.mapped = false;
+    state.map_shared = false;
+    state.map_anonymous = false;
+    state.process_shared = false;
+    state.shared_ready = 0;
+    memset(&state.lock, 0, sizeof(state.lock));
+    bool ok = write_range(fd, (const char*)&state, sizeof(heap), 0);
+
+    char* start = (char*)get_segment_start(h);
+    char* end = (char*)get_heap_end(h);
+    char* pending = start; //start of the bytes not yet written or skipped
+    for (char* index = start; ok && index < end; ) {
+        header* block = (header*)index;
+        size_t size = get_payload(block) + ALIGNMENT;
+        if (check_free(block)) {
+            size_t kept = size < SNAPSHOT_FREE_BYTES ? size : SNAPSHOT_FREE_BYTES;
+            ok = write_range(fd, pending, (size_t)(index + kept - pending), (off_t)(state_size + (size_t)(pending - start)));
+            pending = index + size;
+        }
+        index += size;
+    }
+    ok = ok && write_range(fd, pending, (size_t)(end - pending), (off_t)(state_size + (size_t)(pending - start)));
+    ok = ok && ftruncate(fd, (off_t)(state_size + (*h).segment_size)) == 0; //trailing free space stays a hole
+    if (close(fd) != 0) {
+        ok = false;
+    }
+    return ok;
+}
+
+/* heap_restore
+-----------------
+ Maps a snapshot written by heap_snapshot as a private, copy-on-write heap. Nothing is read 
+ up front: pages are faulted in from the file as they are touched, and changes stay in this 
+ process and never reach the file. The heap is not validated here, since that would touch 
+ every block; call validate_heap_ex when the cost is acceptable.
+
+ @param path: the snapshot file
+ @return: a handle to the restored heap, or NULL if the file holds no compatible heap
+*/
+heap* heap_restore(const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+    size_t length = (size_t)st.st_size;
+    char* base = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        return NULL;
+    }
+
+    heap* h = (heap*)base;
+    if (!check_mapped_state(h, length) || (*h).process_shared) {
+        munmap(base, length);
+        return NULL;
+    }
+    (*h).mapped = true;
+    (*h).page_align = 0;
+    forget_relocations(h);
+    return h;
+}
+
+/* heap_set_root
+------------------
+ Remembers one block of the heap, typically the top of a data structure, so it can be 
+ found again after the heap is reopened.
+
+ @param h: the heap
+ @param root: pointer returned by mymalloc_ex on this heap, or NULL to clear the root
+*/
+void heap_set_root(heap* h, void* root) {
+    (*h).root = root == NULL ? 0 : heap_offset(h, root);
+}
+
+/* heap_get_root
+------------------
+ @param h: the heap
+ @return: the block set with heap_set_root, at its address in the current mapping, or NULL if none
+*/
+void* heap_get_root(heap* h) {
+    return (*h).root == 0 ? NULL : heap_pointer(h, (*h).root);
+}
+
+/* heap_offset
+----------------
+ Converts a pointer into the heap into an offset that stays valid when the heap is mapped 
+ at another address. Data structures in a persistent heap store these instead of pointers.
+
+ @param h: the heap
+ @param ptr: pointer into the heap's segment
+ @return: the offset of the pointer from the segment start, never 0 for a block's payload
+*/
+size_t heap_offset(heap* h, void* ptr) {
+    return (size_t)((char*)ptr - (char*)get_segment_start(h));
+}
+
+/* heap_pointer
+-----------------
+ Converts an offset made by heap_offset back into a pointer in the current mapping.
+
+ @param h: the heap
+ @param offset: the offset
+ @return: the pointer
+*/
+void* heap_pointer(heap* h, size_t offset) {
+    return (char*)get_segment_start(h) + offset;
+}
+
+/* get_default_heap
+---------------
+ Returns the handle of the default heap so it can be passed to the *_ex functions.
+
+ @return: the heap used by myinit/mymalloc/myfree/myrealloc
+*/
+heap* get_default_heap() {
+    return &default_heap;
+}
+
+/* myinit
+---------------
+ Initializes the default heap. Unlike myinit_ex, the heap state of the default heap 
+ lives outside the segment so the whole segment is available to mymalloc.
+
+ @param heap_start: pointer to the start of the heap memory to be managed
+ @param heap_size: the size in bytes of the heap memory to be managed
+ @return: true if the heap was initialized successfully, false otherwise
+*/
+bool myinit(void *heap_start, size_t heap_size) {
+    return init_segment(&default_heap, heap_start, heap_size);
+}
+
+/* table_slot
+----------------
+ Finds the word at the end of a free block's payload that holds the block's index in the 
+ search table. Only blocks of at least TABLE_MIN_PAYLOAD have one, so it never overlaps the 
+ free-list links.
+
+ @param block: pointer to the free block
+ @return: pointer to the slot word
+*/
+unsigned long* table_slot(header* block) {
+    return (unsigned long*)((char*)block + ALIGNMENT + get_payload(block) - sizeof(unsigned long));
+}
+
+/* table_insert
+-----------------
+ Appends a free block to the search table. If the table cannot grow, the table is switched 
+ off and searches fall back to the free list.
+
+ @param h: the heap owning the table
+ @param block: pointer to the free block, already on the free list
+*/
+void table_insert(heap* h, header* block) {
+    search_table* t = (*h).table;
+    unsigned long payload_val = get_payload(block);
+    if (t == NULL || payload_val < TABLE_MIN_PAYLOAD) {
+        return;
+    }
+    if ((*t).count == (*t).capacity) {
+        size_t capacity = (*t).capacity * 2;
+        uint32_t* units = realloc((*t).units, capacity * sizeof(uint32_t));
+        if (units != NULL) {
+            (*t).units = units;
+        }
+        unsigned long* links = units != NULL ? realloc((*t).links, capacity * sizeof(unsigned long)) : NULL;
+        if (links != NULL) {
+            (*t).links = links;
+        }
+        uint32_t* group_max = links != NULL ? realloc((*t).group_max, capacity / TABLE_GROUP * sizeof(uint32_t)) : NULL;
+        if (group_max == NULL) {
+            heap_set_search_table(h, false);
+            return;
+        }
+        (*t).group_max = group_max;
+        (*t).capacity = capacity;
+    }
+    size_t units = payload_val / ALIGNMENT;
+    uint32_t entry = units < INT32_MAX ? (uint32_t)units : INT32_MAX;
+    size_t group = (*t).count / TABLE_GROUP;
+    if ((*t).count % TABLE_GROUP == 0 || entry > (*t).group_max[group]) {
+        (*t).group_max[group] = entry;
+    }
+    (*t).units[(*t).count] = entry;
+    (*t).links[(*t).count] = to_link(h, block);
+    *table_slot(block) = (*t).count;
+    (*t).count++;
+}
+
+/* refresh_group
+------------------
+ Recomputes the maximum of one group of the search table.
+
+ @param t: the table
+ @param group: the group to recompute
+*/
+void refresh_group(search_table* t, size_t group) {
+    size_t start = group * TABLE_GROUP;
+    size_t end = start + TABLE_GROUP < (*t).count ? start + TABLE_GROUP : (*t).count;
+    uint32_t largest = 0;
+    for (size_t i = start; i < end; i++) {
+        if ((*t).units[i] > largest) {
+            largest = (*t).units[i];
+        }
+    }
+    (*t).group_max[group] = largest;
+}
+
+/* table_remove
+-----------------
+ Removes a free block from the search table by moving the last entry into its place. 
+ It must be called before the block's payload changes, while its slot can still be found.
+
+ @param h: the heap owning the table
+ @param block: pointer to the free block
+*/
+void table_remove(heap* h, header* block) {
+    search_table* t = (*h).table;
+    if (t == NULL || get_payload(block) < TABLE_MIN_PAYLOAD) {
+        return;
+    }
+    size_t slot = *table_slot(block);
+    size_t last = --(*t).count;
+    uint32_t removed = (*t).units[slot];
+    uint32_t moved = (*t).units[last];
+    if (slot != last) {
+        (*t).units[slot] = moved;
+        (*t).links[slot] = (*t).links[last];
+        *table_slot(from_link(h, (*t).links[slot])) = slot;
+    }
+
+    size_t group = slot / TABLE_GROUP;
+    size_t last_group = last / TABLE_GROUP;
+    if (removed == (*t).group_max[group]) {
+        refresh_group(t, group);
+    } else if (moved > (*t).group_max[group]) {
+        (*t).group_max[group] = moved;
+    }
+    if (last_group != group && moved == (*t).group_max[last_group]) {
+        refresh_group(t, last_group);
+    }
+}
+
+/* table_rebuild
+------------------
+ Refills the search table from the free list, after the free list was rebuilt.
+
+ @param h: the heap owning the table
+*/
+void table_rebuild(heap* h) {
+    if ((*h).table == NULL) {
+        return;
+    }
+    (*(*h).table).count = 0;
+    header* curr = from_link(h, (*h).freelist_start);
+    while (curr != NULL && (*h).table != NULL) {
+        table_insert(h, curr);
+        curr = next_free(h, curr);
+    }
+}
+
+/* find_first_scalar
+----------------------
+ Finds the first value of at least the given size, one value at a time.
+
+ @param values: the values to scan
+ @param count: the number of values
+ @param units: the size to look for
+ @return: the index of the first value of at least units, or count if there is none
+*/
+size_t find_first_scalar(const uint32_t* values, size_t count, uint32_t units) {
+    size_t i = 0;
+    while (i < count && values[i] < units) {
+        i++;
+    }
+    return i;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/* find_first_sse2
+--------------------
+ Finds the first value of at least the given size, comparing four values per instruction. 
+ The values are below INT32_MAX, so the signed compare is exact.
+
+ @param values: the values to scan
+ @param count: the number of values
+ @param units: the size to look for, at least 1
+ @return: the index of the first value of at least units, or count if there is none
+*/
+__attribute__((target("sse2")))
+size_t find_first_sse2(const uint32_t* values, size_t count, uint32_t units) {
+    __m128i need = _mm_set1_epi32((int)units - 1);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i sizes = _mm_loadu_si128((const __m128i*)&values[i]);
+        int mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(sizes, need)));
+        if (mask != 0) {
+            return i + (size_t)__builtin_ctz((unsigned int)mask);
+        }
+    }
+    return i + find_first_scalar(values + i, count - i, units);
+}
+
+/* find_first_avx2
+--------------------
+ Finds the first value of at least the given size, comparing eight values per instruction.
+
+ @param values: the values to scan
+ @param count: the number of values
+ @param units: the size to look for, at least 1
+ @return: the index of the first value of at least units, or count if there is none
+*/
+__attribute__((target("avx2")))
+size_t find_first_avx2(const uint32_t* values, size_t count, uint32_t units) {
+    __m256i need = _mm256_set1_epi32((int)units - 1);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256i sizes = _mm256_loadu_si256((const __m256i*)&values[i]);
+        int mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(sizes, need)));
+        if (mask != 0) {
+            return i + (size_t)__builtin_ctz((unsigned int)mask);
+        }
+    }
+    return i + find_first_scalar(values + i, count - i, units);
+}
+#endif
+
+/* select_find_first
+----------------------
+ Picks the fastest scan the processor supports, checked once with CPUID.
+
+ @return: the scan function
+*/
+find_first_fn select_find_first() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return find_first_avx2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return find_first_sse2;
+    }
+#endif
+    return find_first_scalar;
+}
+
+// scan used by table_find, chosen by select_find_first when the first search table is built
+find_first_fn find_first = find_first_scalar;
+
+/* table_find
+---------------
+ Finds the first entry of the search table of at least the given size. The group maxima 
+ are scanned first, and then only the entries of the first group that holds a large 
+ enough block, so a search reads about 1/TABLE_GROUP of the table plus one group.
+
+ @param t: the table to scan
+ @param units: the payload needed, in units of ALIGNMENT, from 1 to below INT32_MAX
+ @param steps: receives the number of group maxima and entries read
+ @return: the index of the entry, or the table's count if none is large enough
+*/
+size_t table_find(search_table* t, uint32_t units, size_t* steps) {
+    size_t groups = ((*t).count + TABLE_GROUP - 1) / TABLE_GROUP;
+    size_t group = (*find_first)((*t).group_max, groups, units);
+    *steps = group < groups ? group + 1 : groups;
+    if (group == groups) {
+        return (*t).count;
+    }
+    size_t start = group * TABLE_GROUP;
+    size_t length = start + TABLE_GROUP < (*t).count ? TABLE_GROUP : (*t).count - start;
+    size_t found = (*find_first)((*t).units + start, length, units);
+    *steps += found + 1;
+    return start + found;
+}
+
+/* search_freelist
+--------------------
+ Searches the list of free blocks and returns the first block that is large enough 
+ to accommodate the requested size. If no suitable block is found, it returns NULL. 
+ With the search table on, the table's group maxima and then one group of entries are 
+ scanned instead of the list, so the search reads contiguous memory rather than one 
+ header per free block. With prefetching on, the list walk requests the node after the 
+ next one while it examines the current one.
+
+ @param h: the heap to search
+ @param request: the requested size for the block
+ @return: pointer to the first free block large enough to accommodate the request, or NULL if no such block is found
+*/
+header* search_freelist(heap* h, size_t request) {
+    search_table* t = (*h).table;
+    if (t != NULL && request / ALIGNMENT < INT32_MAX) {
+        if (request < TABLE_MIN_PAYLOAD) { //every free block fits, including those not in the table
+            (*h).stats.search_steps++;
+            return from_link(h, (*h).freelist_start);
+        }
+        size_t steps = 0;
+        size_t found = table_find(t, (uint32_t)(request / ALIGNMENT), &steps);
+        (*h).stats.search_steps += steps;
+        return found < (*t).count ? from_link(h, (*t).links[found]) : NULL;
+    }
+
+    header* curr = from_link(h, (*h).freelist_start);
+    header* ahead = (*h).prefetch && curr != NULL ? next_free(h, curr) : NULL; //next node, already requested
+    size_t steps = 0;
+
+    __builtin_prefetch(ahead);
+    while(curr != NULL) {
+        steps++;
+        if (ahead != NULL) { //ahead was requested an iteration ago, so its link arrives sooner
+            ahead = next_free(h, ahead);
+            __builtin_prefetch(ahead);
+        }
+        bool free = check_free(curr);
+        if (free && get_payload(curr) >= request) {
+            break;
+        }
+        curr = next_free(h, curr);
+    }
+
+    (*h).stats.search_steps += steps;
+    return curr;
+}
+
+/* heap_set_search_table
+--------------------------
+ Switches the search table on or off. The table keeps the size of every free block in one 
+ array, so a search scans a few cache lines instead of chasing a pointer per free block. 
+ It costs an array entry per free block and is kept in process memory, so it is not 
+ available for heaps shared between processes.
+
+ @param h: the heap to configure
+ @param enabled: true to build the table, false to release it
+ @return: true if the table is in the requested state, false if it could not be built
+*/
+bool heap_set_search_table(heap* h, bool enabled) {
+    if (!enabled) {
+        if ((*h).table != NULL) {
+            free((*(*h).table).units);
+            free((*(*h).table).links);
+            free((*(*h).table).group_max);
+            free((*h).table);
+            (*h).table = NULL;
+        }
+        return true;
+    }
+    if ((*h).process_shared) {
+        return false;
+    }
+    if ((*h).table != NULL) {
+        return true;
+    }
+    search_table* t = (search_table*)calloc(1, sizeof(search_table));
+    if (t == NULL) {
+        return false;
+    }
+    (*t).capacity = TABLE_INITIAL;
+    (*t).units = malloc(TABLE_INITIAL * sizeof(uint32_t));
+    (*t).links = malloc(TABLE_INITIAL * sizeof(unsigned long));
+    (*t).group_max = malloc(TABLE_INITIAL / TABLE_GROUP * sizeof(uint32_t));
+    (*h).table = t;
+    find_first = select_find_first();
+    if ((*t).units == NULL || (*t).links == NULL || (*t).group_max == NULL) {
+        heap_set_search_table(h, false);
+        return false;
+    }
+    table_rebuild(h);
+    return (*h).table != NULL;
+}
+
+/* remove_freelist
+--------------------
+ Removes a block from the list of free blocks. This is typically used when a free 
+ block is allocated and is no longer available for use. Built with SAFE_LINKING, each 
+ neighbour is checked once before it is touched: its link must name a block of the 
+ segment and that block must point back at this one.
+
+ @param h: the heap owning the free list
+ @param new: pointer to the block to be removed from the free list
+*/
+void remove_freelist(heap* h, header* new) {
+    unsigned long prev = read_link(h, &(*new).prev);
+    unsigned long next = read_link(h, &(*new).next);
+    header* prev_header = from_link(h, prev);
+    header* next_header = from_link(h, next);
+#ifdef SAFE_LINKING
+    unsigned long link = to_link(h, new);
+    if (!in_segment(h, prev) || !in_segment(h, next)
+        || (prev_header != NULL ? read_link(h, &(*prev_header).next) : (*h).freelist_start) != link
+        || (next_header != NULL && read_link(h, &(*next_header).prev) != link)) { //both neighbours must point back at the block
+        link_corrupt(h, new);
+    }
+#endif
+    stats_count(h, get_payload(new), true, -1);
+    table_remove(h, new);
+
+    if (prev_header == NULL) { //first element in linked list
+        (*h).freelist_start = next;
+    } else {
+        store_link(h, &(*prev_header).next, next);
+    }
+    if (next_header != NULL) {
+        store_link(h, &(*next_header).prev, prev);
+    }
+}
+
+/* get_next_block
+-------------------
+ Retrieves the block that comes after a given block in memory.
+
+ @param h: the heap containing the block
+ @param block: pointer to the block
+ @return: pointer to the next block in memory, or NULL if the given block is the last one in memory
+*/
+header* get_next_block(heap* h, header* block) {
+    unsigned long payload_val = get_payload(block);
+    char* next_location = (char*)block + payload_val + ALIGNMENT;
+    if ((void*)next_location == get_heap_end(h)) {
+        return NULL;
+    } 
+    return (header*)next_location;
+}
+
+/* coalesce
+-------------
+ Combines a block with the next block in memory if the next block is free, effectively 
+ creating a larger free block. This helps in reducing fragmentation and making larger 
+ chunks of memory available for allocation.
+
+ @param h: the heap containing the block
+ @param block: pointer to the block to be coalesced with the next block
+*/
+void coalesce(heap* h, header* block) {
+    header* next_block = get_next_block(h, block);
+    bool free = check_free(next_block);
+
+    if (next_block == NULL || !free) {
+        return;
+    }
+    
+    unsigned long next_payload_val = get_payload(next_block);
+    unsigned long added_space = next_payload_val + ALIGNMENT;
+    unsigned long payload_val = get_payload(block);
+    bool block_free = check_free(block);
+    if ((*h).check_cursor == to_link(h, next_block)) { //keep the validation cursor on a block boundary
+        (*h).check_cursor = to_link(h, block);
+    }
+    if ((*h).compact_cursor == to_link(h, next_block)) {
+        (*h).compact_cursor = to_link(h, block);
+    }
+    if ((*h).defrag_cursor == to_link(h, next_block)) {
+        (*h).defrag_cursor = to_link(h, block);
+    }
+    remove_freelist(h, next_block);
+    if (block_free) {
+        table_remove(h, block);
+    }
+    stats_count(h, payload_val, block_free, -1);
+    (*block).payload += added_space;
+    stats_count(h, payload_val + added_space, block_free, 1);
+    (*h).stats.coalesces++;
+    if (block_free) {
+        stamp_free(h, block);
+        table_insert(h, block);
+    }
+    
+}
+
+/* add_freelist
+-------------------
+ Adds a block to the free list. This typically happens when a block is freed or when 
+ a large block is split into two smaller blocks.
+
+ @param h: the heap owning the free list
+ @param new: pointer to the block to be added to the free list
+*/
+void add_freelist(heap* h, header* new) {
+    header* freelist_start = from_link(h, (*h).freelist_start);
+    unsigned long new_link = to_link(h, new);
+    stats_count(h, get_payload(new), true, 1);
+    stamp_free(h, new);
+    table_insert(h, new);
+    if (freelist_start == NULL) {
+        (*h).freelist_start = new_link;
+        store_link(h, &(*new).prev, 0);
+        store_link(h, &(*new).next, 0);
+        return;
+    }
+
+    store_link(h, &(*freelist_start).prev, new_link);
+    store_link(h, &(*new).next, (*h).freelist_start);
+    store_link(h, &(*new).prev, 0);
+    (*h).freelist_start = new_link;
+}
+
+/* add_block
+--------------
+ Splits a block into two: one of the requested size and the other containing the remaining space. 
+
+ @param h: the heap containing the block
+ @param block: pointer to the block to be split
+ @param request: the requested size for the new block
+*/
+void add_block(heap* h, header* block, size_t request) {
+    bool free = check_free(block);
+    char* location = (char*)block;
+    unsigned long payload_val = get_payload(block);   
+    purge_info* info = free ? get_purge_info(h, block) : NULL;
+    purge_info kept = {0, PURGE_DIRTY};
+    if (info != NULL) {
+        kept = *info;
+    }
+    if (free) {
+        remove_freelist(h, block);
+    } else {
+        stats_count(h, payload_val, false, -1);
+    }
+    (*block).payload = request + 1;
+    stats_count(h, request, false, 1);
+    header* new = (header*)(location + request + ALIGNMENT);
+    (*new).payload = payload_val - request - ALIGNMENT;
+    add_freelist(h, new);
+    purge_info* new_info = get_purge_info(h, new);
+    if (new_info != NULL && kept.state != PURGE_DIRTY) { //the remainder's interior pages are still released
+        *new_info = kept;
+    }
+    coalesce(h, new);
+}
+
+/* coalesce_multiple_blocks
+-----------------------------
+ Continuously merges a block with its subsequent free blocks until it has enough space 
+ to accommodate the specified size.
+
+ @param h: the heap containing the block
+ @param block: pointer to the block to be coalesced with subsequent free blocks
+ @param req: the requested size that the block should be able to accommodate after coalescing
+*/
+void coalesce_multiple_blocks(heap* h, header* block, unsigned long req) {
+    header* next_block = get_next_block(h, block); //coalesce right block while it is free
+    while (check_free(next_block) && get_payload(block) < req) {
+        coalesce(h, block);
+        next_block = get_next_block(h, block);
+    }
+}
+
+/* check_blocks
+-----------------
+ Checks up to `budget` blocks starting at the validation cursor. Each block must fit in the 
+ segment, and a free block must be linked consistently with its free-list neighbors. All 
+ checks look only at the block and its neighbors, so the cost of a call is bounded by the 
+ budget no matter how large the heap is.
+
+ @param h: the heap to check
+ @param budget: the maximum number of blocks to check
+ @return: NULL if every checked block was valid, otherwise the first damaged block
+*/
+header* check_blocks(heap* h, size_t budget) {
+    char* end = (char*)get_heap_end(h);
+    header* block = from_link(h, (*h).check_cursor);
+
+    for (size_t i = 0; i < budget; i++) {
+        char* index = (char*)block;
+        unsigned long payload_val = get_payload(block);
+        if (payload_val < 16 || payload_val + ALIGNMENT > (size_t)(end - index)) {
+            (*h).check_cursor = to_link(h, get_segment_start(h));
+            return block; //block goes outside heap segment
+        }
+
+        if (check_free(block)) {
+            unsigned long link = to_link(h, block);
+            unsigned long prev_link = read_link(h, &(*block).prev);
+            unsigned long next_link = read_link(h, &(*block).next);
+            header* prev = from_link(h, prev_link);
+            header* next = from_link(h, next_link);
+            bool linked = in_segment(h, prev_link) && in_segment(h, next_link)
+                && (prev != NULL ? read_link(h, &(*prev).next) == link : (*h).freelist_start == link)
+                && (next == NULL || read_link(h, &(*next).prev) == link);
+            if (!linked) {
+                (*h).check_cursor = to_link(h, get_segment_start(h));
+                return block;
+            }
+        }
+
+        (*h).stats.blocks_checked++;
+        index += payload_val + ALIGNMENT;
+        block = index == end ? get_segment_start(h) : (header*)index; //wrap around at the end
+    }
+
+    (*h).check_cursor = to_link(h, block);
+    return NULL;
+}
+
+/* validate_heap_step_ex
+--------------------------
+ Validates the next `budget` blocks of the heap, continuing from where the previous call 
+ stopped and wrapping around at the end of the segment.
+
+ @param h: the heap to validate
+ @param budget: the maximum number of blocks to check
+ @return: true if the checked blocks are valid, false otherwise
+*/
+bool validate_heap_step_ex(heap* h, size_t budget) {
+    if (needs_lock(h)) {
+        if (!shared_lock(h)) {
+            return false;
+        }
+        bool result = validate_heap_step_ex(h, budget);
+        shared_unlock(h);
+        return result;
+    }
+    return check_blocks(h, budget) == NULL;
+}
+
+/* validate_heap_step
+-----------------------
+ Validates the next `budget` blocks of the default heap.
+
+ @param budget: the maximum number of blocks to check
+ @return: true if the checked blocks are valid, false otherwise
+*/
+bool validate_heap_step(size_t budget) {
+    return validate_heap_step_ex(&default_heap, budget);
+}
+
+/* heap_set_sampled_check
+---------------------------
+ Enables continuous validation: every `interval` calls to mymalloc_ex/myfree_ex check the 
+ next `budget` blocks. An interval of 0 disables it.
+
+ @param h: the heap to check
+ @param interval: the number of calls between checks
+ @param budget: the number of blocks checked each time
+ @param handler: called with the damaged block when a check fails, or NULL to abort
+*/
+void heap_set_sampled_check(heap* h, size_t interval, size_t budget, heap_corruption_handler handler) {
+    (*h).check_interval = interval;
+    (*h).check_budget = budget;
+    (*h).check_countdown = interval;
+    (*h).on_corrupt = (*h).process_shared ? NULL : handler; //function addresses differ between processes
+}
+
+/* sampled_check
+------------------
+ Runs one sampled validation step and reports a damaged block to the heap's handler.
+
+ @param h: the heap to check
+*/
+void sampled_check(heap* h) {
+    (*h).check_countdown = (*h).check_interval;
+    header* bad = check_blocks(h, (*h).check_budget);
+    if (bad == NULL) {
+        return;
+    }
+
+    if ((*h).on_corrupt != NULL) {
+        (*h).on_corrupt(h, (void*)bad);
+        return;
+    }
+    fprintf(stderr, "heap %p: corrupted block at %p\n", (void*)h, (void*)bad);
+    abort();
+}
+
+/* get_trailer
+-----------------
+ Locates the trailer at the end of a sampled block's payload.
+
+ @param block: pointer to a block with TRAILER_BIT set
+ @return: pointer to the block's trailer
+*/
+trailer* get_trailer(header* block) {
+    return (trailer*)((char*)block + get_payload(block));
+}
+
+/* next_sample_gap
+--------------------
+ Draws the number of bytes until the next sample from an exponential distribution with 
+ mean equal to the sampling period. -ln(u) is computed from the bit length of a random 
+ integer plus a quadratic fit of log2 on the mantissa, which is plenty accurate for 
+ sampling and avoids a dependency on libm.
+
+ @param profile: the profiler state holding the period and random generator
+ @return: the number of bytes to allocate before the next sample
+*/
+long next_sample_gap(heap_profile* profile) {
+    uint64_t x = (*profile).rng; //xorshift64*
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    (*profile).rng = x;
+    uint64_t r = (x * 0x2545F4914F6CDD1DULL) | 1;
+
+    int top = 63 - __builtin_clzll(r);
+    double mantissa = (double)(r << (63 - top)) / 9223372036854775808.0 - 1.0; //in [0, 1)
+    double log2_u = (top - 64) + mantissa * (1.3465 - 0.3465 * mantissa);
+    double gap = -log2_u * 0.6931471805599453 * (double)(*profile).period;
+    return gap < 1.0 ? 1 : (long)gap;
+}
+
+__thread char* stack_low; // lowest address of the calling thread's stack, set by the first capture
+__thread char* stack_high; // one past its highest address, NULL until the stack has been looked up
+
+/* find_stack_bounds
+----------------------
+ Looks up the calling thread's stack once, so capture_stack never reads outside it.
+
+ @return: true if the bounds are known, false if the thread's attributes could not be read
+*/
+bool find_stack_bounds() {
+    pthread_attr_t attr;
+    void* low = NULL;
+    size_t size = 0;
+    if (pthread_getattr_np(pthread_self(), &attr) != 0) {
+        return false;
+    }
+    bool found = pthread_attr_getstack(&attr, &low, &size) == 0;
+    pthread_attr_destroy(&attr);
+    if (found) {
+        stack_low = (char*)low;
+        stack_high = (char*)low + size;
+    }
+    return found;
+}
+
+/* capture_stack
+------------------
+ Records the return addresses of the current call stack by following saved frame pointers. 
+ The walk stops at the first frame link that does not point a little further up the stack, 
+ which is where code compiled without frame pointers leaves the chain. Every frame is also 
+ checked against the thread's stack bounds before it is read, since a register reused as 
+ data can hold a value that passes the other checks.
+
+ @param frames: the array receiving the return addresses
+ @param skip: the number of innermost callers to leave out
+ @return: the number of return addresses recorded
+*/
+__attribute__((noinline)) size_t capture_stack(void** frames, size_t skip) {
+    void** frame = (void**)__builtin_frame_address(0);
+    size_t depth = 0;
+    if (stack_high == NULL && !find_stack_bounds()) {
+        return 0;
+    }
+
+    while (frame != NULL && depth < PROFILE_MAX_DEPTH) {
+        if ((char*)frame < stack_low || (char*)(frame + 2) > stack_high) { //the link left the stack
+            break;
+        }
+        void** next = (void**)frame[0];
+        void* ret = frame[1];
+        if (ret == NULL) {
+            break;
+        }
+        if (skip > 0) {
+            skip--;
+        } else {
+            frames[depth++] = ret;
+        }
+        if (next <= frame || (char*)next - (char*)frame > (1 << 20) || ((uintptr_t)next % sizeof(void*)) != 0) {
+            break;
+        }
+        frame = next;
+    }
+    return depth;
+}
+
+/* find_site
+--------------
+ Finds the profile entry for a call stack, claiming an empty slot for a new stack.
+
+ @param profile: the profiler state
+ @param frames: the return addresses of the stack
+ @param depth: the number of return addresses
+ @return: the index of the site, or PROFILE_SITES if the table is full
+*/
+size_t find_site(heap_profile* profile, void** frames, size_t depth) {
+    uint64_t hash = depth;
+    for (size_t i = 0; i < depth; i++) {
+        hash = (hash ^ (uint64_t)(uintptr_t)frames[i]) * 0x100000001B3ULL;
+    }
+
+    for (size_t probe = 0; probe < PROFILE_SITES; probe++) {
+        size_t index = (hash + probe) & (PROFILE_SITES - 1);
+        profile_site* site = &(*profile).sites[index];
+        if ((*site).depth == 0) {
+            (*site).depth = depth;
+            memcpy((*site).frames, frames, depth * sizeof(void*));
+            return index;
+        }
+        if ((*site).depth == depth && memcmp((*site).frames, frames, depth * sizeof(void*)) == 0) {
+            return index;
+        }
+    }
+    return PROFILE_SITES;
+}
+
+/* malloc_sampled
+-------------------
+ Slow path of mymalloc_ex taken when the sampling countdown runs out. The block is allocated 
+ with room for a trailer naming its allocation site, and the site is charged for it.
+
+ @param h: the heap to allocate from
+ @param requested_size: the size in bytes requested by the caller
+ @return: a pointer to the allocated block, or NULL if allocation failed
+*/
+__attribute__((noinline)) void* malloc_sampled(heap* h, size_t requested_size) {
+    heap_profile* profile = (*h).profile;
+    (*h).sample_countdown = LONG_MAX; //no nested sample while allocating this one
+    if (profile == NULL || !(*profile).sampling) {
+        return mymalloc_ex(h, requested_size);
+    }
+    size_t guard_countdown = (*h).guard_countdown; //the trailer must be written into a heap block
+    (*h).guard_countdown = 0;
+
+    void* frames[PROFILE_MAX_DEPTH];
+    size_t depth = capture_stack(frames, 1); //leave out the return into malloc_sampled
+    size_t site = find_site(profile, frames, depth);
+    void* ptr = NULL;
+
+    if (site == PROFILE_SITES || requested_size > UINT_MAX) {
+        (*profile).dropped++;
+        ptr = mymalloc_ex(h, requested_size);
+    } else {
+        ptr = mymalloc_ex(h, requested_size + sizeof(trailer));
+        if (ptr != NULL) {
+            header* block = (header*)((char*)ptr - ALIGNMENT);
+            (*block).payload |= TRAILER_BIT;
+            trailer* tag = get_trailer(block);
+            (*tag).site = (unsigned int)site;
+            (*tag).size = (unsigned int)requested_size;
+
+            profile_site* entry = &(*profile).sites[site];
+            (*entry).live_count++;
+            (*entry).live_bytes += requested_size;
+            (*entry).total_count++;
+            (*entry).total_bytes += requested_size;
+        }
+    }
+
+    (*h).guard_countdown = guard_countdown;
+    (*h).sample_countdown = next_sample_gap(profile);
+    return ptr;
+}
+
+/* release_sample
+-------------------
+ Subtracts a sampled block from its allocation site and drops its trailer.
+
+ @param h: the heap owning the block
+ @param block: pointer to a block with TRAILER_BIT set
+*/
+void release_sample(heap* h, header* block) {
+    trailer* tag = get_trailer(block);
+    heap_profile* profile = (*h).profile;
+    if (profile != NULL) {
+        profile_site* site = &(*profile).sites[(*tag).site];
+        (*site).live_count--;
+        (*site).live_bytes -= (*tag).size;
+    }
+    (*block).payload &= ~TRAILER_BIT;
+}
+
+struct sigaction guard_previous_action; // SIGSEGV action in place before guard_fault
+pthread_once_t guard_handler_once = PTHREAD_ONCE_INIT;
+
+/* guard_slot_page
+--------------------
+ Locates the page of a slot in the guarded pool.
+
+ @param pool: the guarded pool
+ @param slot: the index of the slot
+ @return: the first byte of the slot's page
+*/
+char* guard_slot_page(guard_pool* pool, size_t slot) {
+    return (*pool).start + (*pool).page * (2 * slot + 1);
+}
+
+/* guard_owns
+---------------
+ Checks whether a pointer lies in a heap's guarded pool rather than in the heap itself.
+
+ @param h: the heap
+ @param ptr: the pointer to check
+ @return: true if the pointer is inside the guarded pool
+*/
+bool guard_owns(heap* h, void* ptr) {
+    guard_pool* pool = (*h).guard;
+    return pool != NULL && (char*)ptr >= (*pool).start && (char*)ptr < (*pool).start + (*pool).length;
+}
+
+/* next_guard_gap
+-------------------
+ Draws the number of mymalloc_ex calls until the next guarded sample, uniformly from 
+ 1 to twice the sampling rate less one, so the mean is the rate but samples cannot line 
+ up with a pattern in the caller.
+
+ @param pool: the guarded pool holding the rate and random generator
+ @return: the number of calls until the next sample
+*/
+size_t next_guard_gap(guard_pool* pool) {
+    uint64_t x = (*pool).rng; //xorshift64*
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    (*pool).rng = x;
+    return 1 + (size_t)((x * 0x2545F4914F6CDD1DULL) >> 33) % (2 * (*pool).rate - 1);
+}
+
+/* guard_report
+-----------------
+ Describes a memory error caught by the guarded pool on stderr, with the stacks that 
+ allocated and freed the block involved. It runs inside the fault handler, so it only 
+ formats into the stream with dprintf.
+
+ @param pool: the guarded pool
+ @param what: the kind of error
+ @param slot: the slot of the block involved
+ @param addr: the address that was accessed
+*/
+void guard_report(guard_pool* pool, const char* what, size_t slot, void* addr) {
+    guard_slot* info = &(*pool).slots[slot];
+    char* block = guard_slot_page(pool, slot) + (*pool).page - roundup((*info).size, ALIGNMENT);
+    dprintf(STDERR_FILENO, "guarded heap: %s at %p, block %p of %zu bytes\n", what, addr, (void*)block, (*info).size);
+    dprintf(STDERR_FILENO, "  allocated by:\n");
+    for (size_t i = 0; i < (*info).alloc_depth; i++) {
+        dprintf(STDERR_FILENO, "    #%zu %p\n", i, (*info).alloc_frames[i]);
+    }
+    if (!(*info).live) {
+        dprintf(STDERR_FILENO, "  freed by:\n");
+        for (size_t i = 0; i < (*info).free_depth; i++) {
+            dprintf(STDERR_FILENO, "    #%zu %p\n", i, (*info).free_frames[i]);
+        }
+    }
+}
+
+/* guard_fault
+----------------
+ SIGSEGV handler. A fault inside a guarded pool is reported as a use after free when it 
+ hits a freed slot, or as an overflow or underflow when it hits the guard page after or 
+ before a live block. The previous action is then restored and the access retried, so 
+ the process still dies (or is handled) as it would have without the pool.
+
+ @param sig: the signal number
+ @param info: the fault information, holding the address accessed
+ @param context: the interrupted context, passed on to a previous handler
+*/
+void guard_fault(int sig, siginfo_t* info, void* context) {
+    char* addr = (char*)(*info).si_addr;
+    guard_pool* pool = __atomic_load_n(&guard_pools, __ATOMIC_ACQUIRE);
+    while (pool != NULL && (addr < (*pool).start || addr >= (*pool).start + (*pool).length)) {
+        pool = __atomic_load_n(&(*pool).next, __ATOMIC_ACQUIRE);
+    }
+
+    if (pool != NULL) {
+        size_t index = (size_t)(addr - (*pool).start) / (*pool).page;
+        size_t before = index / 2 - (index % 2 == 0 ? 1 : 0); //slot ending at or containing the page
+        if (index % 2 == 1 && (*pool).slots[before].used) {
+            guard_report(pool, (*pool).slots[before].live ? "invalid access" : "use after free", before, addr);
+        } else if (index % 2 == 0 && index != 0 && (*pool).slots[before].live) {
+            guard_report(pool, "buffer overflow", before, addr);
+        } else if (index % 2 == 0 && index / 2 < (*pool).slot_count && (*pool).slots[index / 2].live) {
+            guard_report(pool, "buffer underflow", index / 2, addr);
+        } else {
+            dprintf(STDERR_FILENO, "guarded heap: wild access at %p\n", (void*)addr);
+        }
+    }
+
+    sigaction(SIGSEGV, &guard_previous_action, NULL);
+    if ((guard_previous_action.sa_flags & SA_SIGINFO) && guard_previous_action.sa_sigaction != NULL) {
+        guard_previous_action.sa_sigaction(sig, info, context);
+    }
+}
+
+/* install_guard_handler
+--------------------------
+ Installs guard_fault for SIGSEGV, keeping the previous action to fall back on.
+*/
+void install_guard_handler() {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = guard_fault;
+    action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGSEGV, &action, &guard_previous_action);
+}
+
+/* heap_set_guarded_sampling
+------------------------------
+ Turns guarded sampling on or off. With it on, about one in every rate calls to 
+ mymalloc_ex is served from a page of its own, placed against an inaccessible guard page. 
+ Freed pages stay inaccessible until the other freed slots have been reused. Overflows 
+ and uses after free then fault right away and are reported with the stacks involved. 
+ The pool is kept in process memory, so it is not available for shared or persistent heaps.
+
+ @param h: the heap to configure
+ @param rate: the mean number of calls per guarded sample, or 0 to stop sampling
+ @param slots: the number of guarded slots, used when the pool is first created
+ @return: true if sampling is in the requested state, false if the pool could not be created
+*/
+bool heap_set_guarded_sampling(heap* h, size_t rate, size_t slots) {
+    if (rate == 0) {
+        (*h).guard_countdown = 0; //blocks already in the pool stay valid
+        return true;
+    }
+    if ((*h).process_shared || (*h).map_shared) {
+        return false;
+    }
+    if ((*h).guard == NULL) {
+        if (slots == 0) {
+            return false;
+        }
+        guard_pool* pool = (guard_pool*)calloc(1, sizeof(guard_pool));
+        if (pool == NULL) {
+            return false;
+        }
+        (*pool).page = (size_t)sysconf(_SC_PAGESIZE);
+        (*pool).slot_count = slots;
+        (*pool).length = (*pool).page * (2 * slots + 1);
+        (*pool).start = mmap(NULL, (*pool).length, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        (*pool).slots = (guard_slot*)calloc(slots, sizeof(guard_slot));
+        (*pool).freed = (size_t*)malloc(slots * sizeof(size_t));
+        if ((*pool).start == MAP_FAILED || (*pool).slots == NULL || (*pool).freed == NULL) {
+            if ((*pool).start != MAP_FAILED) {
+                munmap((*pool).start, (*pool).length);
+            }
+            free((*pool).slots);
+            free((*pool).freed);
+            free(pool);
+            return false;
+        }
+        (*pool).rng = ((uint64_t)(uintptr_t)pool ^ (uint64_t)time(NULL) * 0x9E3779B97F4A7C15ULL) | 1;
+
+        pthread_once(&guard_handler_once, install_guard_handler);
+        pthread_mutex_lock(&guard_pools_lock);
+        (*pool).next = guard_pools;
+        __atomic_store_n(&guard_pools, pool, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&guard_pools_lock);
+        (*h).guard = pool;
+    }
+    (*(*h).guard).rate = rate;
+    (*h).guard_countdown = next_guard_gap((*h).guard);
+    return true;
+}
+
+/* malloc_guarded
+-------------------
+ Slow path of mymalloc_ex taken when the guarded sampling countdown runs out. The block 
+ is placed at the end of a free slot's page, so the first byte past it is in the guard 
+ page. Slots never used are taken first, then the slot freed longest ago. Requests are 
+ capped at a page less ALIGNMENT bytes, so the word in front of a guarded block is always 
+ readable.
+
+ @param h: the heap whose pool is used
+ @param requested_size: the size in bytes requested by the caller
+ @return: a pointer to the guarded block, or NULL if the request cannot be guarded
+*/
+__attribute__((noinline)) void* malloc_guarded(heap* h, size_t requested_size) {
+    guard_pool* pool = (*h).guard;
+    (*h).guard_countdown = next_guard_gap(pool);
+    if (requested_size == 0 || requested_size > (*pool).page - ALIGNMENT) {
+        return NULL;
+    }
+
+    size_t slot = 0;
+    if ((*pool).unused < (*pool).slot_count) {
+        slot = (*pool).unused++;
+    } else if ((*pool).freed_count != 0) {
+        slot = (*pool).freed[(*pool).freed_head];
+        (*pool).freed_head = ((*pool).freed_head + 1) % (*pool).slot_count;
+        (*pool).freed_count--;
+    } else {
+        return NULL;
+    }
+    char* page = guard_slot_page(pool, slot);
+    if (mprotect(page, (*pool).page, PROT_READ | PROT_WRITE) != 0) {
+        (*pool).freed[((*pool).freed_head + (*pool).freed_count++) % (*pool).slot_count] = slot;
+        return NULL;
+    }
+
+    guard_slot* info = &(*pool).slots[slot];
+    (*info).size = requested_size;
+    (*info).live = true;
+    (*info).used = true;
+    (*info).alloc_depth = capture_stack((*info).alloc_frames, 1); //leave out the return into malloc_guarded
+    (*info).free_depth = 0;
+    (*h).stats.malloc_calls++;
+    return page + (*pool).page - roundup(requested_size, ALIGNMENT);
+}
+
+/* free_guarded
+-----------------
+ Frees a block from the guarded pool. Its page is released and made inaccessible, and the 
+ slot joins the back of the reuse queue. Freeing anything but a live guarded block is 
+ reported and aborts.
+
+ @param h: the heap whose pool holds the block
+ @param ptr: pointer to the block
+*/
+__attribute__((noinline)) void free_guarded(heap* h, void* ptr) {
+    guard_pool* pool = (*h).guard;
+    size_t index = (size_t)((char*)ptr - (*pool).start) / (*pool).page;
+    size_t slot = index / 2;
+    guard_slot* info = &(*pool).slots[slot];
+    char* page = guard_slot_page(pool, slot);
+    if (index % 2 == 0 || !(*info).live || (char*)ptr != page + (*pool).page - roundup((*info).size, ALIGNMENT)) {
+        guard_report(pool, (*info).used && !(*info).live ? "double free" : "invalid free", slot, ptr);
+        abort();
+    }
+
+    (*info).live = false;
+    (*info).free_depth = capture_stack((*info).free_frames, 1); //leave out the return into free_guarded
+    madvise(page, (*pool).page, MADV_DONTNEED);
+    mprotect(page, (*pool).page, PROT_NONE);
+    (*pool).freed[((*pool).freed_head + (*pool).freed_count++) % (*pool).slot_count] = slot;
+    (*h).stats.free_calls++;
+}
+
+/* guard_request_size
+-----------------------
+ Looks up the size requested for a block in the guarded pool, without touching its page.
+
+ @param h: the heap whose pool holds the block
+ @param ptr: pointer into the guarded pool
+ @return: the size requested when the slot was last handed out
+*/
+size_t guard_request_size(heap* h, void* ptr) {
+    guard_pool* pool = (*h).guard;
+    return (*pool).slots[(size_t)((char*)ptr - (*pool).start) / (*pool).page / 2].size;
+}
+
+/* realloc_guarded
+--------------------
+ Resizes a block from the guarded pool by moving it, which frees its slot.
+
+ @param h: the heap whose pool holds the block
+ @param old_ptr: pointer to the guarded block
+ @param new_size: the new size for the block
+ @return: a pointer to the new block, or NULL if reallocation failed
+*/
+void* realloc_guarded(heap* h, void* old_ptr, size_t new_size) {
+    size_t old_request = guard_request_size(h, old_ptr);
+    if (new_size == 0) {
+        free_guarded(h, old_ptr);
+        return NULL;
+    }
+    void* new_ptr = mymalloc_ex(h, new_size);
+    if (new_ptr == NULL) {
+        return NULL;
+    }
+    memcpy(new_ptr, old_ptr, old_request < new_size ? old_request : new_size);
+    free_guarded(h, old_ptr);
+    (*h).stats.realloc_moved++;
+    return new_ptr;
+}
+
+// struct used to store one thread's latency histograms, linked into a list of all threads.
+typedef struct latency_thread {
+    latency_histogram histogram;
+    struct latency_thread* next;
+    bool retired; // its thread has exited and a new thread may take the histograms over
+} latency_thread;
+
+bool latency_enabled; // whether entry points are timed
+latency_thread* latency_threads; // histograms of every thread that has been timed
+__thread latency_thread* latency_local; // histograms of the calling thread
+pthread_key_t latency_key; // retires a thread's histograms when the thread exits
+pthread_once_t latency_key_once = PTHREAD_ONCE_INIT;
+__thread bool latency_timing; // the calling thread is inside a timed call
+
+/* read_cycles
+----------------
+ Reads the CPU timestamp counter, or a nanosecond clock on machines without one.
+
+ @return: the current time in cycles (or nanoseconds)
+*/
+uint64_t read_cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+#endif
+}
+
+/* latency_bucket
+-------------------
+ Maps a duration to its log-linear histogram bucket.
+
+ @param cycles: the duration
+ @return: the index of the bucket counting that duration
+*/
+size_t latency_bucket(uint64_t cycles) {
+    int msb = 63 - __builtin_clzll(cycles | 1);
+    if (msb < LATENCY_SUB_BITS) {
+        return (size_t)cycles;
+    }
+    int shift = msb - LATENCY_SUB_BITS;
+    size_t bucket = ((size_t)(shift + 1) << LATENCY_SUB_BITS) + (size_t)((cycles >> shift) - (1ULL << LATENCY_SUB_BITS));
+    return bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1;
+}
+
+/* latency_bucket_value
+-------------------------
+ Maps a histogram bucket back to the largest duration it counts.
+
+ @param bucket: the index of the bucket
+ @return: the upper bound of the bucket in cycles
+*/
+uint64_t latency_bucket_value(size_t bucket) {
+    if (bucket < (1 << LATENCY_SUB_BITS)) {
+        return bucket;
+    }
+    size_t shift = (bucket >> LATENCY_SUB_BITS) - 1;
+    uint64_t sub = (bucket & ((1 << LATENCY_SUB_BITS) - 1)) + (1ULL << LATENCY_SUB_BITS);
+    return ((sub + 1) << shift) - 1;
+}
+
+/* latency_size_class
+-----------------------
+ Maps a request size to its latency size class.
+
+ @param size: the size in bytes of the request
+ @return: the index of the size class
+*/
+size_t latency_size_class(size_t size) {
+    size_t class = 0;
+    size_t limit = 16;
+    while (size > limit && class < LATENCY_SIZE_CLASSES - 1) {
+        limit <<= 2;
+        class++;
+    }
+    return class;
+}
+
+/* latency_retire
+-------------------
+ Destructor of latency_key, run when a timed thread exits. Its histograms keep their counts 
+ and stay on the list, and the next thread timed for the first time takes them over.
+
+ @param local: the exiting thread's histograms
+*/
+void latency_retire(void* local) {
+    __atomic_store_n(&(*(latency_thread*)local).retired, true, __ATOMIC_RELEASE);
+}
+
+/* latency_key_create
+-----------------------
+ Creates latency_key, once per process.
+*/
+void latency_key_create() {
+    pthread_key_create(&latency_key, latency_retire);
+}
+
+/* latency_claim
+------------------
+ Takes over the histograms of a thread that has exited, so a process that keeps starting 
+ threads holds at most one set of histograms per thread alive at the same time.
+
+ @return: the histograms taken over, or NULL if no exited thread left any
+*/
+latency_thread* latency_claim() {
+    latency_thread* thread = __atomic_load_n(&latency_threads, __ATOMIC_ACQUIRE);
+    while (thread != NULL) {
+        bool retired = true;
+        if (__atomic_load_n(&(*thread).retired, __ATOMIC_RELAXED)
+            && __atomic_compare_exchange_n(&(*thread).retired, &retired, false, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            return thread;
+        }
+        thread = (*thread).next;
+    }
+    return NULL;
+}
+
+/* record_latency
+-------------------
+ Counts one timed call in the calling thread's histograms. On the thread's first call it 
+ takes over the histograms of an exited thread, or creates and publishes new ones. Only 
+ the owning thread writes a histogram, so the counters are updated without atomic 
+ read-modify-write; snapshots read them with relaxed loads.
+
+ @param op: the entry point that was timed
+ @param size: the size in bytes involved in the call
+ @param cycles: the duration of the call
+*/
+void record_latency(latency_op op, size_t size, uint64_t cycles) {
+    latency_thread* local = latency_local;
+    if (local == NULL) {
+        pthread_once(&latency_key_once, latency_key_create);
+        local = latency_claim();
+        if (local == NULL) {
+            local = (latency_thread*)calloc(1, sizeof(latency_thread));
+            if (local == NULL) {
+                return;
+            }
+            (*local).next = __atomic_load_n(&latency_threads, __ATOMIC_ACQUIRE);
+            while (!__atomic_compare_exchange_n(&latency_threads, &(*local).next, local, true, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+            }
+        }
+        pthread_setspecific(latency_key, local);
+        latency_local = local;
+    }
+
+    uint64_t* count = &(*local).histogram.counts[op][latency_size_class(size)][latency_bucket(cycles)];
+    __atomic_store_n(count, __atomic_load_n(count, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+}
+
+/* timed_malloc
+-----------------
+ Runs mymalloc_ex and records how long it took.
+
+ @param h: the heap to allocate from
+ @param requested_size: the size in bytes of the block to be allocated
+ @return: the result of mymalloc_ex
+*/
+void* timed_malloc(heap* h, size_t requested_size) {
+    latency_timing = true;
+    uint64_t start = read_cycles();
+    void* ptr = mymalloc_ex(h, requested_size);
+    uint64_t end = read_cycles();
+    latency_timing = false;
+    record_latency(LATENCY_MALLOC, requested_size, end - start);
+    return ptr;
+}
+
+/* timed_free
+---------------
+ Runs myfree_ex and records how long it took. Blocks in the guarded pool have no header, 
+ and a freed one cannot be read, so their size comes from the pool's slot record.
+
+ @param h: the heap the block was allocated from
+ @param ptr: pointer to the block to be freed
+*/
+void timed_free(heap* h, void* ptr) {
+    size_t size = guard_owns(h, ptr) ? guard_request_size(h, ptr) : get_payload((header*)((char*)ptr - ALIGNMENT));
+    latency_timing = true;
+    uint64_t start = read_cycles();
+    myfree_ex(h, ptr);
+    uint64_t end = read_cycles();
+    latency_timing = false;
+    record_latency(LATENCY_FREE, size, end - start);
+}
+
+/* timed_realloc
+------------------
+ Runs myrealloc_ex and records how long it took.
+
+ @param h: the heap the block was allocated from
+ @param old_ptr: the pointer to the block to be reallocated
+ @param new_size: the new size for the block
+ @return: the result of myrealloc_ex
+*/
+void* timed_realloc(heap* h, void* old_ptr, size_t new_size) {
+    latency_timing = true;
+    uint64_t start = read_cycles();
+    void* ptr = myrealloc_ex(h, old_ptr, new_size);
+    uint64_t end = read_cycles();
+    latency_timing = false;
+    record_latency(LATENCY_REALLOC, new_size, end - start);
+    return ptr;
+}
+
+/* defer_free
+---------------
+ Puts a freed block on the quick list for its exact payload size instead of merging it. 
+ The block keeps its used bit so coalescing leaves it alone until the next consolidation.
+
+ @param h: the heap owning the block
+ @param block: pointer to the block being freed
+*/
+void defer_free(heap* h, header* block) {
+    unsigned long payload_val = get_payload(block);
+    stats_count(h, payload_val, false, -1);
+    (*h).stats.blocks_deferred++;
+    (*h).stats.bytes_deferred += payload_val;
+
+    unsigned long* bin = &(*h).quick_bins[payload_val / ALIGNMENT];
+    (*block).payload |= QUICK_BIT;
+    store_link(h, &(*block).next, *bin);
+    *bin = to_link(h, block);
+
+    if ((*h).stats.blocks_deferred > (*h).quick_max_count) {
+        heap_consolidate(h);
+    }
+}
+
+/* take_quick
+---------------
+ Reuses a deferred block whose payload is exactly the requested size by popping the head 
+ of that size's quick list.
+
+ @param h: the heap to allocate from
+ @param request: the rounded size of the request, at most quick_max_size
+ @return: the reused block, or NULL if no deferred block has that size
+*/
+header* take_quick(heap* h, size_t request) {
+    unsigned long* bin = &(*h).quick_bins[request / ALIGNMENT];
+    header* block = from_link(h, *bin);
+    if (block == NULL) {
+        return NULL;
+    }
+
+    *bin = load_link(h, block, &(*block).next);
+    (*block).payload &= ~QUICK_BIT;
+    (*h).stats.blocks_deferred--;
+    (*h).stats.bytes_deferred -= request;
+    stats_count(h, request, false, 1);
+    return block;
+}
+
+/* heap_set_prefetch
+----------------------
+ Turns software prefetching in the heap walks on or off.
+
+ @param h: the heap to configure
+ @param enabled: true to prefetch ahead of each walk
+*/
+void heap_set_prefetch(heap* h, bool enabled) {
+    (*h).prefetch = enabled;
+}
+
+/* heap_set_size_classes
+--------------------------
+ Turns size-class rounding on or off. With it on, requests up to SIZE_CLASS_MAX get the 
+ payload of their size class instead of the next multiple of ALIGNMENT, so a freed block 
+ fits every later request of its class.
+
+ @param h: the heap to configure
+ @param enabled: true to round requests to size classes
+*/
+void heap_set_size_classes(heap* h, bool enabled) {
+    (*h).size_classes = enabled;
+}
+
+/* heap_set_cache_lines
+-------------------------
+ Gives requests of at least the given size cache lines of their own. Such a block starts 
+ on a cache line boundary and is padded to end where the next line starts, so blocks used 
+ by different threads never share a line.
+
+ @param h: the heap to configure
+ @param min_size: the smallest request that is padded, or 0 to turn padding off
+*/
+void heap_set_cache_lines(heap* h, size_t min_size) {
+    (*h).cache_line_min = min_size;
+}
+
+/* heap_good_size
+-------------------
+ Reports the payload a request would get, so a caller can use the whole block.
+
+ @param h: the heap the request would be made to
+ @param size: the requested size in bytes
+ @return: the payload size allocated for the request
+*/
+size_t heap_good_size(heap* h, size_t size) {
+    return round_request(h, size);
+}
+
+/* heap_set_deferred_free
+---------------------------
+ Enables or disables deferred coalescing. Disabling it merges every waiting block.
+
+ @param h: the heap to configure
+ @param max_size: the largest payload that is deferred (at most QUICK_MAX_SIZE), or 0 to disable deferring
+ @param max_deferred: the number of waiting blocks that triggers a consolidation
+*/
+void heap_set_deferred_free(heap* h, size_t max_size, size_t max_deferred) {
+    if (max_size > QUICK_MAX_SIZE) {
+        max_size = QUICK_MAX_SIZE;
+    }
+    (*h).quick_max_size = max_size;
+    (*h).quick_max_count = max_deferred;
+    if (max_size == 0) {
+        heap_consolidate(h);
+    }
+}
+
+/* heap_consolidate
+---------------------
+ Returns every deferred block to the heap and merges all adjacent free blocks in a single 
+ pass over the segment. The free list is rebuilt in address order along the way, which 
+ also lets first fit prefer low addresses afterwards.
+
+ @param h: the heap to consolidate
+*/
+void heap_consolidate(heap* h) {
+    if (needs_lock(h)) {
+        if (shared_lock(h)) {
+            heap_consolidate(h);
+            shared_unlock(h);
+        }
+        return;
+    }
+    for (size_t i = 0; i < QUICK_BINS; i++) { //deferred blocks become ordinary free blocks
+        header* quick = from_link(h, (*h).quick_bins[i]);
+        while (quick != NULL) {
+            header* next = next_free(h, quick);
+            unsigned long payload_val = get_payload(quick);
+            (*quick).payload = payload_val;
+            stats_count(h, payload_val, true, 1);
+            quick = next;
+        }
+        (*h).quick_bins[i] = 0;
+    }
+    (*h).stats.blocks_deferred = 0;
+    (*h).stats.bytes_deferred = 0;
+    (*h).stats.consolidations++;
+
+    char* index = (char*)get_segment_start(h);
+    char* end = (char*)get_heap_end(h);
+    header* run = NULL; //first free block of the current run of free blocks
+    header* tail = NULL; //last block of the rebuilt free list
+    (*h).freelist_start = 0;
+
+    while (index < end) {
+        header* block = (header*)index;
+        unsigned long payload_val = get_payload(block);
+        index += payload_val + ALIGNMENT;
+
+        if (!check_free(block)) {
+            run = NULL;
+            continue;
+        }
+
+        if (run != NULL) { //merge into the start of the run
+            unsigned long run_payload = get_payload(run);
+            stats_count(h, payload_val, true, -1);
+            stats_count(h, run_payload, true, -1);
+            (*run).payload = run_payload + payload_val + ALIGNMENT;
+            stats_count(h, get_payload(run), true, 1);
+            (*h).stats.coalesces++;
+            stamp_free(h, run);
+            continue;
+        }
+
+        run = block;
+        store_link(h, &(*block).prev, to_link(h, tail));
+        store_link(h, &(*block).next, 0);
+        if (tail == NULL) {
+            (*h).freelist_start = to_link(h, block);
+        } else {
+            store_link(h, &(*tail).next, to_link(h, block));
+        }
+        tail = block;
+    }
+
+    table_rebuild(h);
+    (*h).check_cursor = to_link(h, get_segment_start(h)); //merged blocks may have held the cursors
+    (*h).compact_cursor = 0;
+    (*h).defrag_cursor = 0;
+}
+
+/* purge_block
+-----------------
+ Releases the physical pages lying wholly inside a free block's payload, past its links 
+ and purge record and before its search-table slot, and marks the block as purged.
+
+ @param h: the heap containing the block
+ @param block: pointer to the free block
+ @param info: the block's purge record
+ @return: the number of bytes released
+*/
+size_t purge_block(heap* h, header* block, purge_info* info) {
+    size_t page = (*h).purge_page;
+    char* start = (char*)roundup((size_t)((char*)block + sizeof(header) + sizeof(purge_info)), page);
+    char* end = (char*)(((size_t)block + ALIGNMENT + get_payload(block) - sizeof(unsigned long)) & ~(page - 1)); //keep the table slot
+    if (end <= start) {
+        return 0;
+    }
+
+    int advice = MADV_DONTNEED;
+    unsigned long state = PURGE_ZEROED;
+#ifdef MADV_FREE
+    if ((*h).purge_lazy) {
+        advice = MADV_FREE;
+        state = PURGE_LAZY;
+    }
+#endif
+    if (!(*h).map_anonymous) { //only private anonymous pages are known to come back zeroed
+        state = PURGE_LAZY;
+    }
+    if (madvise(start, (size_t)(end - start), advice) != 0) {
+        return 0;
+    }
+    (*info).state = state;
+    (*h).stats.purges++;
+    (*h).stats.bytes_purged += (size_t)(end - start);
+    return (size_t)(end - start);
+}
+
+/* purge_blocks
+-----------------
+ Purges every large free block that has been idle since before the given time.
+
+ @param h: the heap to purge
+ @param idle_since: blocks that last changed at or before this time are purged
+ @return: the number of bytes released
+*/
+size_t purge_blocks(heap* h, uint64_t idle_since) {
+    size_t released = 0;
+    header* curr = from_link(h, (*h).freelist_start);
+    while (curr != NULL) {
+        purge_info* info = get_purge_info(h, curr);
+        if (info != NULL && (*info).state == PURGE_DIRTY && (*info).freed_at <= idle_since) {
+            released += purge_block(h, curr, info);
+        }
+        curr = next_free(h, curr);
+    }
+    return released;
+}
+
+/* purge_tick
+---------------
+ Called every PURGE_CHECK_INTERVAL frees. Walks the free list for idle blocks at most 
+ twice per purge delay, so the cost of purging follows elapsed time and not call count.
+
+ @param h: the heap to purge
+*/
+void purge_tick(heap* h) {
+    (*h).purge_countdown = PURGE_CHECK_INTERVAL;
+    uint64_t now = now_ms();
+    uint64_t period = (*h).purge_delay / 2 > 0 ? (*h).purge_delay / 2 : 1;
+    if (now - (*h).last_purge < period) {
+        return;
+    }
+    (*h).last_purge = now;
+    if (now >= (*h).purge_delay) {
+        purge_blocks(h, now - (*h).purge_delay);
+    }
+}
+
+/* heap_set_purge
+-------------------
+ Enables or disables purging of idle free memory. Every free block present when purging 
+ is enabled starts its idle time now.
+
+ @param h: the heap to configure
+ @param delay_ms: how long a free block stays unused before its pages are released, or 0 to disable purging
+ @param flags: HEAP_PURGE_LAZY to release pages with MADV_FREE, otherwise 0
+*/
+void heap_set_purge(heap* h, uint64_t delay_ms, int flags) {
+    bool was_enabled = (*h).purge_delay != 0;
+    (*h).purge_delay = delay_ms;
+    (*h).purge_lazy = (flags & HEAP_PURGE_LAZY) != 0;
+    (*h).purge_page = (size_t)sysconf(_SC_PAGESIZE);
+    (*h).purge_countdown = PURGE_CHECK_INTERVAL;
+    (*h).last_purge = now_ms();
+    if (delay_ms == 0 || was_enabled) {
+        return;
+    }
+
+    header* curr = from_link(h, (*h).freelist_start); //records were not kept while purging was off
+    while (curr != NULL) {
+        stamp_free(h, curr);
+        curr = next_free(h, curr);
+    }
+}
+
+/* heap_purge
+---------------
+ Releases the pages of every large free block right away, however long it has been idle. 
+ Does nothing while purging is disabled.
+
+ @param h: the heap to purge
+ @return: the number of bytes released
+*/
+size_t heap_purge(heap* h) {
+    if (needs_lock(h)) {
+        if (!shared_lock(h)) {
+            return 0;
+        }
+        size_t result = heap_purge(h);
+        shared_unlock(h);
+        return result;
+    }
+    if ((*h).purge_delay == 0) {
+        return 0;
+    }
+    (*h).last_purge = now_ms();
+    return purge_blocks(h, UINT64_MAX);
+}
+
+/* search_aligned
+--------------------
+ Searches the list of free blocks for the first one that can hold the request at an 
+ aligned payload address. The space in front of the aligned payload must either be empty 
+ or large enough to remain a free block of its own.
+
+ @param h: the heap to search
+ @param request: the rounded size of the request
+ @param alignment: the required payload alignment, a power of two
+ @param payload_out: receives the aligned payload address inside the returned block
+ @return: the free block containing the aligned payload, or NULL if no block fits
+*/
+header* search_aligned(heap* h, size_t request, size_t alignment, char** payload_out) {
+    header* curr = from_link(h, (*h).freelist_start);
+    size_t steps = 0;
+
+    while (curr != NULL) {
+        steps++;
+        char* start = (char*)curr + ALIGNMENT;
+        char* end = start + get_payload(curr);
+        char* aligned = (char*)roundup((size_t)start, alignment);
+        if (aligned != start && (size_t)(aligned - start) < ALIGNMENT * 3) { //gap too small for a free block
+            aligned += alignment;
+        }
+        if (aligned <= end && (size_t)(end - aligned) >= request) {
+            *payload_out = aligned;
+            break;
+        }
+        curr = next_free(h, curr);
+    }
+
+    (*h).stats.search_steps += steps;
+    return curr;
+}
+
+/* mymemalign_ex
+------------------
+ Allocates a block whose payload starts at a multiple of the given alignment. The part of 
+ the chosen free block in front of the aligned payload stays behind as a smaller free 
+ block, and any large enough remainder after it is split off as usual. The block is 
+ released with myfree_ex like any other.
+
+ @param h: the heap to allocate from
+ @param alignment: the required payload alignment, a power of two
+ @param requested_size: the size in bytes of the block to be allocated
+ @return: a pointer to the aligned block, or NULL if allocation failed
+*/
+void* mymemalign_ex(heap* h, size_t alignment, size_t requested_size) {
+    if (needs_lock(h)) {
+        if (!shared_lock(h)) {
+            return NULL;
+        }
+        void* result = mymemalign_ex(h, alignment, requested_size);
+        shared_unlock(h);
+        return result;
+    }
+    if (alignment < ALIGNMENT || (alignment & (alignment - 1)) != 0 || requested_size > MAX_REQUEST_SIZE) {
+        return NULL;
+    }
+    size_t request = roundup(requested_size, ALIGNMENT);
+    (*h).stats.malloc_calls++;
+
+    char* aligned = NULL;
+    header* block = search_aligned(h, request, alignment, &aligned);
+    if (block == NULL && (*h).stats.blocks_deferred != 0) { //merge deferred blocks and retry
+        heap_consolidate(h);
+        block = search_aligned(h, request, alignment, &aligned);
+    }
+    if (block == NULL) {
+        (*h).stats.malloc_failures++;
+        return NULL;
+    }
+
+    size_t lead = (size_t)(aligned - ((char*)block + ALIGNMENT));
+    if (lead != 0) { //leave the space in front as its own free block
+        unsigned long payload_val = get_payload(block);
+        table_remove(h, block);
+        stats_count(h, payload_val, true, -1);
+        (*block).payload = lead - ALIGNMENT;
+        stats_count(h, lead - ALIGNMENT, true, 1);
+        table_insert(h, block);
+        header* new = (header*)(aligned - ALIGNMENT);
+        (*new).payload = payload_val - lead;
+        add_freelist(h, new);
+        block = new;
+    }
+
+    unsigned long payload_val = get_payload(block);
+    if (payload_val >= request + (ALIGNMENT * 3)) {
+        add_block(h, block, request);
+    } else {
+        remove_freelist(h, block);
+        (*block).payload += 1;
+        stats_count(h, payload_val, false, 1);
+    }
+    return (void*)aligned;
+}
+
+/* mymalloc_ex
+-------------
+ Allocates a block of memory of the specified size from the heap. It does this by searching 
+ the free block list for a suitable block. If a suitable block is found, it is removed from 
+ the free list and returned to the caller.
+
+ @param h: the heap to allocate from
+ @param requested_size: the size in bytes of the block to be allocated
+ @return: a pointer to the allocated block, or NULL if allocation failed
+*/
+void *mymalloc_ex(heap* h, size_t requested_size) {
+    if (__atomic_load_n(&latency_enabled, __ATOMIC_RELAXED) && !latency_timing) {
+        return timed_malloc(h, requested_size);
+    }
+    if (needs_lock(h)) {
+        if (!shared_lock(h)) {
+            return NULL;
+        }
+        void* result = mymalloc_ex(h, requested_size);
+        shared_unlock(h);
+        return result;
+    }
+    if ((*h).check_interval != 0 && --(*h).check_countdown == 0) {
+        sampled_check(h);
+    }
+    if ((*h).guard_countdown != 0 && --(*h).guard_countdown == 0) {
+        void* guarded = malloc_guarded(h, requested_size);
+        if (guarded != NULL) {
+            return guarded;
+        }
+    }
+    (*h).sample_countdown -= (long)requested_size;
+    if ((*h).sample_countdown < 0) {
+        return malloc_sampled(h, requested_size);
+    }
+    size_t request = round_request(h, requested_size);
+    if ((*h).page_align != 0 && request >= (*h).page_align) { //large blocks get huge pages of their own
+        return mymemalign_ex(h, (*h).page_align, requested_size);
+    }
+    if (cache_padded(h, requested_size)) { //padded blocks start on a cache line
+        return mymemalign_ex(h, CACHE_LINE, request);
+    }
+    (*h).stats.malloc_calls++;
+    if (request <= (*h).quick_max_size) { //exact-size reuse of a deferred block
+        header* quick = take_quick(h, request);
+        if (quick != NULL) {
+            return (void*)((char*)quick + ALIGNMENT);
+        }
+    }
+    header* free_location = search_freelist(h, request); 
+
+    if (free_location == NULL && (*h).stats.blocks_deferred != 0) { //merge deferred blocks and retry
+        heap_consolidate(h);
+        free_location = search_freelist(h, request);
+    }
+    if (free_location == NULL) { //no available blocks 
+        (*h).stats.malloc_failures++;
+        return NULL;
+    }
+    if (request > MAX_REQUEST_SIZE) {
+        (*h).stats.malloc_failures++;
+        return NULL;
+    }
+
+    unsigned long payload_val = get_payload(free_location);
+    char* location = (char*)free_location;
+
+    if (location + payload_val + ALIGNMENT == get_heap_end(h)) {//last block and add new header special case
+
+        if (payload_val >= request + (ALIGNMENT * 3)) {
+            add_block(h, free_location, request);
+            return (void*)(location + ALIGNMENT);
+        }
+        
+    }
+
+    (*free_location).payload += 1; //update the free block
+    remove_freelist(h, free_location);
+    stats_count(h, payload_val, false, 1);
+    return (void*)(location + ALIGNMENT);     
+}
+
+/* mymalloc
+-------------
+ Allocates a block of memory of the specified size from the default heap.
+
+ @param requested_size: the size in bytes of the block to be allocated
+ @return: a pointer to the allocated block, or NULL if allocation failed
+*/
+void *mymalloc(size_t requested_size) {
+    return mymalloc_ex(&default_heap, requested_size);
+}
+
+/* mycalloc_ex
+----------------
+ Allocates a zeroed array. Pages of the block that were purged with MADV_DONTNEED while it 
+ was free already read back as zero, so only the rest of the block is cleared.
+
+ @param h: the heap to allocate from
+ @param count: the number of elements
+ @param size: the size in bytes of each element
+ @return: a pointer to the zeroed block, or NULL if allocation failed
+*/
+void *mycalloc_ex(heap* h, size_t count, size_t size) {
+    if (size != 0 && count > MAX_REQUEST_SIZE / size) {
+        return NULL;
+    }
+    size_t total = count * size;
+    char* ptr = (char*)mymalloc_ex(h, total);
+    if (ptr == NULL || guard_owns(h, ptr)) { //guarded pages are released on free, so they read back as zero
+        return ptr;
+    }
+
+    header* block = (header*)(ptr - ALIGNMENT);
+    purge_info* info = get_purge_info(h, block);
+    if (info == NULL || (*info).state != PURGE_ZEROED) {
+        memset(ptr, 0, total);
+        return ptr;
+    }
+    //the record was read before the block was ever handed out, so it still describes its pages
+    size_t page = (*h).purge_page;
+    char* start = (char*)roundup((size_t)(ptr + sizeof(header) - ALIGNMENT + sizeof(purge_info)), page);
+    char* end = (char*)(((size_t)ptr + get_payload(block) - sizeof(unsigned long)) & ~(page - 1));
+    char* limit = ptr + total;
+    if (end <= start || start >= limit) {
+        memset(ptr, 0, total);
+        return ptr;
+    }
+    memset(ptr, 0, (size_t)(start - ptr));
+    if (end < limit) {
+        memset(end, 0, (size_t)(limit - end));
+    }
+    return ptr;
+}
+
+/* mycalloc
+-------------
+ Allocates a zeroed array from the default heap.
+
+ @param count: the number of elements
+ @param size: the size in bytes of each element
+ @return: a pointer to the zeroed block, or NULL if allocation failed
+*/
+void *mycalloc(size_t count, size_t size) {
+    return mycalloc_ex(&default_heap, count, size);
+}
+
+/* myfree_ex
+-----------
+ Frees a block of memory, making it available for future allocations. The block is added 
+ back to the free list and coalesced with any adjacent free blocks.
+
+ @param h: the heap the block was allocated from
+ @param ptr: pointer to the block to be freed
+*/
+void myfree_ex(heap* h, void *ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+    if (__atomic_load_n(&latency_enabled, __ATOMIC_RELAXED) && !latency_timing) {
+        timed_free(h, ptr);
+        return;
+    }
+    if (needs_lock(h)) {
+        if (shared_lock(h)) {
+            myfree_ex(h, ptr);
+            shared_unlock(h);
+        }
+        return;
+    }
+    if ((*h).check_interval != 0 && --(*h).check_countdown == 0) {
+        sampled_check(h);
+    }
+    if (guard_owns(h, ptr)) {
+        free_guarded(h, ptr);
+        return;
+    }
+    if ((*h).purge_delay != 0 && --(*h).purge_countdown == 0) {
+        purge_tick(h);
+    }
+
+    header* block = (header*)((char*)ptr - ALIGNMENT);
+    if ((*block).payload & TRAILER_BIT) {
+        release_sample(h, block);
+    }
+    (*h).stats.free_calls++;
+    if (get_payload(block) <= (*h).quick_max_size) {
+        defer_free(h, block);
+        return;
+    }
+    stats_count(h, get_payload(block), false, -1);
+    (*block).payload -= 1;
+    add_freelist(h, block);
+    coalesce(h, block);   
+}
+
+/* myfree
+-----------
+ Frees a block of memory allocated from the default heap.
+
+ @param ptr: pointer to the block to be freed
+*/
+void myfree(void *ptr) {
+    myfree_ex(&default_heap, ptr);
+}
+
+/* myrealloc_ex
+--------------
+ Resizes an allocated block to a new size. If the block is large enough to accommodate the 
+ new size, it is split into two: one of the new size and the other containing the remaining 
+ space. If the block is not large enough, a new block of the requested size is allocated, 
+ the contents of the old block are copied to the new block, and the old block is freed.
+
+ @param h: the heap the block was allocated from
+ @param old_ptr: the pointer to the block to be reallocated
+ @param new_size: the new size for the block
+ @return: a pointer to the newly allocated block, or NULL if reallocation failed
+*/
+void *myrealloc_ex(heap* h, void *old_ptr, size_t new_size) {
+    if (__atomic_load_n(&latency_enabled, __ATOMIC_RELAXED) && !latency_timing) {
+        return timed_realloc(h, old_ptr, new_size);
+    }
+    if (needs_lock(h)) {
+        if (!shared_lock(h)) {
+            return NULL;
+        }
+        void* result = myrealloc_ex(h, old_ptr, new_size);
+        shared_unlock(h);
+        return result;
+    }
+    if (old_ptr == NULL) {
+        return mymalloc_ex(h, new_size);
+    }
+    if (guard_owns(h, old_ptr)) { //guarded blocks are always moved
+        return realloc_guarded(h, old_ptr, new_size);
+    }
+
+    unsigned long request = round_request(h, new_size);
+    header* old_header = (header*)((char*)old_ptr - ALIGNMENT);
+    unsigned long old_size = get_payload(old_header);
+
+    if (new_size == 0) { //realloc(0) case
+        myfree_ex(h, old_ptr);
+        return NULL; 
+    }
+
+    if ((*old_header).payload & TRAILER_BIT) { //sampled blocks are always moved so the sample is released
+        unsigned int old_request = (*get_trailer(old_header)).size;
+        void* new_ptr = mymalloc_ex(h, new_size);
+        if (new_ptr == NULL) {
+            return NULL;
+        }
+        memcpy(new_ptr, old_ptr, old_request < new_size ? old_request : new_size);
+        myfree_ex(h, old_ptr);
+        (*h).stats.realloc_moved++;
+        return new_ptr;
+    }
+
+    coalesce_multiple_blocks(h, old_header, request); //coalsce until enough space or right block occupied
+
+    if (get_payload(old_header) >= request) { //in place realloc
+        void* block_end = (void*)(get_payload(old_header) + (char*)old_ptr);
+
+        if (block_end == get_heap_end(h) && request + (ALIGNMENT * 3) < get_payload(old_header)) {
+            header* new = (header*)((char*)old_ptr + request); 
+            (*new).payload = get_payload(old_header) - request - ALIGNMENT;
+            stats_count(h, get_payload(old_header), false, -1);
+            (*old_header).payload = request + 1;
+            stats_count(h, request, false, 1);
+            add_freelist(h, new);
+        } //last block on the heap, prevents heap exhuastion 
+
+        if (block_end != get_heap_end(h) && old_size >= request + (ALIGNMENT * 3)) {  
+            add_block(h, old_header, request);
+        }
+        
+        (*h).stats.realloc_in_place++;
+        return old_ptr;
+    }
+    
+    (*h).stats.realloc_moved++;
+    void* new_ptr = mymalloc_ex(h, new_size);
+    void* check = memcpy(new_ptr, old_ptr, old_size);
+    assert(check != NULL);
+    myfree_ex(h, old_ptr);
+    return new_ptr;
+}
+
+/* myrealloc
+--------------
+ Resizes a block allocated from the default heap.
+
+ @param old_ptr: the pointer to the block to be reallocated
+ @param new_size: the new size for the block
+ @return: a pointer to the newly allocated block, or NULL if reallocation failed
+*/
+void *myrealloc(void *old_ptr, size_t new_size) {
+    return myrealloc_ex(&default_heap, old_ptr, new_size);
+}
+
+/* validate_heap_ex
+------------------
+ Validates the state of the heap. It checks whether the blocks are correctly aligned, 
+ whether the total size of the blocks matches the size of the heap, whether there are 
+ any overlapping blocks, whether the free list correctly contains all the free blocks, 
+ whether the quick lists hold exactly the deferred blocks, each on the list for its size, 
+ and, with the search table on, whether it holds exactly the free blocks large enough for a slot.
+
+ @param h: the heap to validate
+ @return: true if the heap is valid, false otherwise
+*/
+bool validate_heap_ex(heap* h) {
+    if (needs_lock(h)) {
+        if (!shared_lock(h)) {
+            return false;
+        }
+        bool result = validate_heap_ex(h);
+        shared_unlock(h);
+        return result;
+    }
+    char* index = (char*)get_segment_start(h);
+    header* block = get_segment_start(h);
+    unsigned long total_heap_used = 0;
+    size_t total_deferred = 0;
+    size_t total_free = 0;
+    while ((void*)index != get_heap_end(h)) {
+        if (index > (char*)get_heap_end(h)) {
+            return false; //block goes outside heap segment
+        }
+        if ((*h).prefetch) {
+            __builtin_prefetch(index + PREFETCH_AHEAD);
+        }
+        unsigned long payload_val = get_payload(block);
+        if ((*block).payload & QUICK_BIT) {
+            total_deferred++;
+        }
+        if (check_free(block)) {
+            total_free++;
+        }
+        if ((payload_val % ALIGNMENT) != 0) {
+            return false;
+        }
+ 
+        total_heap_used += payload_val + ALIGNMENT;
+        index += payload_val + ALIGNMENT;
+        block = (header*)index;
+    }
+
+    if (total_heap_used != (*h).segment_size) {
+        return false;
+    }
+
+    if (!in_segment(h, (*h).freelist_start)) {
+        return false;
+    }
+    header* curr = from_link(h, (*h).freelist_start);
+    size_t total_linked = 0;
+    size_t total_tabled = 0;
     while (curr != NULL) {
         bool free = check_free(curr);
-        if (!free || (get_payload(curr) % ALIGNMENT) != 0) {
+        if (!free || (get_payload(curr) % ALIGNMENT) != 0 || !in_segment(h, read_link(h, &(*curr).next))) {
+            return false;
+        }
+        if (++total_linked > total_free) {
+            return false; //cycle in the free list
+        }
+        if ((*h).table != NULL && get_payload(curr) >= TABLE_MIN_PAYLOAD) { //the block's slot names it
+            size_t slot = *table_slot(curr);
+            if (slot >= (*(*h).table).count || (*(*h).table).links[slot] != to_link(h, curr)) {
+                return false;
+            }
+            total_tabled++;
+        }
+        curr = from_link(h, read_link(h, &(*curr).next));
+    }
+    if ((*h).table != NULL && total_tabled != (*(*h).table).count) {
+        return false;
+    }
+    search_table* t = (*h).table;
+    for (size_t start = 0; t != NULL && start < (*t).count; start += TABLE_GROUP) { //each group maximum is exact
+        uint32_t largest = 0;
+        for (size_t i = start; i < start + TABLE_GROUP && i < (*t).count; i++) {
+            largest = (*t).units[i] > largest ? (*t).units[i] : largest;
+        }
+        if (largest != (*t).group_max[start / TABLE_GROUP]) {
             return false;
         }
-        curr = (header*)(*curr).next;
     }
 
+    if (total_deferred != (*h).stats.blocks_deferred) {
+        return false;
+    }
+    size_t total_quick = 0;
+    for (size_t i = 0; i < QUICK_BINS; i++) { //every deferred block sits on the list for its size
+        for (unsigned long link = (*h).quick_bins[i]; link != 0; link = read_link(h, &(*from_link(h, link)).next)) {
+            header* quick = from_link(h, link);
+            if (!in_segment(h, link) || !((*quick).payload & QUICK_BIT) || get_payload(quick) != i * ALIGNMENT) {
+                return false;
+            }
+            if (++total_quick > total_deferred) {
+                return false; //cycle in a quick list
+            }
+        }
+    }
+    if (total_quick != total_deferred) {
+        return false;
+    }
+
+    return true;
+}
+
+/* validate_heap
+------------------
+ Validates the state of the default heap.
+
+ @return: true if the heap is valid, false otherwise
+*/
+bool validate_heap() {
+    return validate_heap_ex(&default_heap);
+}
+
+/* dump_heap_ex
+--------------
+ Prints the current state of the heap. It prints the payload size and the free/used status 
+ of each block, as well as the total size of the heap and the total amount of free space.
+
+ @param h: the heap to print
+*/
+void dump_heap_ex(heap* h) {
+    char* index = (char*)get_segment_start(h);
+    header *block = get_segment_start(h);
+
+    while((void*)index != get_heap_end(h)) {
+        if ((*h).prefetch) {
+            __builtin_prefetch(index + PREFETCH_AHEAD);
+        }
+        unsigned long payload_val = get_payload(block);
+        bool free = check_free(block);
+
+        printf("Block at %p: payload=%lu, free=%s\n", index, payload_val, free ? "true" : "false");
+        
+        index += payload_val + ALIGNMENT;
+        block = (header*)index;
+    }
+}
+
+/* dump_heap
+--------------
+ Prints the current state of the default heap.
+*/
+void dump_heap() {
+    dump_heap_ex(&default_heap);
+}
+
+// struct stored at the start of the block backing an arena.
+struct arena {
+    heap* parent;
+    char* base; // first byte of the bump region
+    char* top; // next byte to hand out
+    char* limit; // end of the bump region
+    void* oversize; // most recent fallback block; each one links to the one before it
+};
+
+// requests larger than capacity / ARENA_OVERSIZE_DIVISOR bypass the bump region
+const size_t ARENA_OVERSIZE_DIVISOR = 4;
+
+/* arena_create
+-----------------
+ Creates an arena backed by a single block of the given heap. Allocations from the arena 
+ are served from that block until it is full. On a huge-page backed heap the block is 
+ rounded to whole huge pages and starts on a huge-page boundary.
+
+ @param h: the heap that backs the arena
+ @param capacity: the size in bytes of the bump region
+ @return: a pointer to the new arena, or NULL if the heap could not supply the block
+*/
+arena* arena_create(heap* h, size_t capacity) {
+    size_t state_size = roundup(sizeof(arena), ALIGNMENT);
+    capacity = roundup(capacity, ALIGNMENT);
+    if ((*h).page_align != 0) { //whole huge pages, which mymalloc_ex places on huge-page boundaries
+        capacity = roundup(state_size + capacity, (*h).page_align) - state_size;
+    }
+    arena* a = (arena*)mymalloc_ex(h, state_size + capacity);
+    if (a == NULL) {
+        return NULL;
+    }
+
+    (*a).parent = h;
+    (*a).base = (char*)a + state_size;
+    (*a).top = (*a).base;
+    (*a).limit = (*a).base + capacity;
+    (*a).oversize = NULL;
+    return a;
+}
+
+/* arena_alloc_oversize
+-------------------------
+ Serves an arena request from the parent heap. The block is prefixed with a link to the 
+ previous fallback block so arena_rollback() and arena_reset() can find it again.
+
+ @param a: the arena making the request
+ @param request: the size in bytes to allocate, already rounded to ALIGNMENT
+ @return: a pointer to the memory, or NULL if the parent heap is full
+*/
+void* arena_alloc_oversize(arena* a, size_t request) {
+    void** block = (void**)mymalloc_ex((*a).parent, request + ALIGNMENT);
+    if (block == NULL) {
+        return NULL;
+    }
+    *block = (*a).oversize;
+    (*a).oversize = (void*)block;
+    return (void*)((char*)block + ALIGNMENT);
+}
+
+/* arena_alloc
+-----------------
+ Allocates memory from an arena by bumping its top pointer. Requests that are too large for 
+ the space left (or for the arena as a whole) are passed on to the parent heap.
+
+ @param a: the arena to allocate from
+ @param requested_size: the size in bytes to allocate
+ @return: a pointer to the memory, or NULL if allocation failed
+*/
+void* arena_alloc(arena* a, size_t requested_size) {
+    if (requested_size == 0 || requested_size > MAX_REQUEST_SIZE) {
+        return NULL;
+    }
+
+    size_t request = roundup(requested_size, ALIGNMENT);
+    char* top = (*a).top;
+    size_t capacity = (size_t)((*a).limit - (*a).base);
+
+    if (request > (size_t)((*a).limit - top) || request > capacity / ARENA_OVERSIZE_DIVISOR) {
+        return arena_alloc_oversize(a, request);
+    }
+
+    (*a).top = top + request;
+    return (void*)top;
+}
+
+/* arena_checkpoint
+---------------------
+ Records the current position of an arena. Checkpoints nest: rolling back to one 
+ invalidates any checkpoint taken after it.
+
+ @param a: the arena
+ @return: a mark that arena_rollback() can return the arena to
+*/
+arena_mark arena_checkpoint(arena* a) {
+    arena_mark mark;
+    mark.used = (size_t)((*a).top - (*a).base);
+    mark.oversize = (*a).oversize;
+    return mark;
+}
+
+/* arena_rollback
+-------------------
+ Releases everything allocated from an arena since the given checkpoint. The bump region 
+ is released in constant time; fallback blocks are returned to the parent heap one by one.
+
+ @param a: the arena
+ @param mark: a checkpoint previously returned by arena_checkpoint()
+*/
+void arena_rollback(arena* a, arena_mark mark) {
+    while ((*a).oversize != mark.oversize) {
+        void** block = (void**)(*a).oversize;
+        (*a).oversize = *block;
+        myfree_ex((*a).parent, (void*)block);
+    }
+    (*a).top = (*a).base + mark.used;
+}
+
+/* arena_reset
+----------------
+ Releases everything allocated from an arena, leaving it empty and ready for reuse.
+
+ @param a: the arena
+*/
+void arena_reset(arena* a) {
+    arena_mark empty = {0, NULL};
+    arena_rollback(a, empty);
+}
+
+/* arena_destroy
+------------------
+ Releases an arena and returns its backing block to the parent heap.
+
+ @param a: the arena
+*/
+void arena_destroy(arena* a) {
+    if (a == NULL) {
+        return;
+    }
+    arena_reset(a);
+    myfree_ex((*a).parent, (void*)a);
+}
+
+/* get_handle_table
+---------------------
+ @param h: the heap
+ @return: the heap's handle table, or NULL if no handle was ever allocated
+*/
+handle_entry* get_handle_table(heap* h) {
+    if ((*h).handle_table == 0) {
+        return NULL;
+    }
+    return (handle_entry*)((char*)from_link(h, (*h).handle_table) + ALIGNMENT);
+}
+
+/* get_handle_entry
+---------------------
+ @param h: the heap
+ @param handle: a handle of the heap
+ @return: the table entry of the handle, or NULL if it is not a handle in use
+*/
+handle_entry* get_handle_entry(heap* h, heap_handle handle) {
+    if (handle == 0 || handle > (*h).handle_capacity) {
+        return NULL;
+    }
+    handle_entry* entry = &get_handle_table(h)[handle - 1];
+    return (*entry).link == 0 ? NULL : entry;
+}
+
+/* block_handle
+-----------------
+ Determines whether a used block belongs to a handle. A handle block starts with its handle, 
+ and the handle's entry links back to the block, so any other block whose payload happens 
+ to start with a plausible handle is told apart by the back link.
+
+ @param h: the heap containing the block
+ @param block: pointer to a used block
+ @return: the handle owning the block, or 0 if the block is not a handle block
+*/
+heap_handle block_handle(heap* h, header* block) {
+    heap_handle handle = *(heap_handle*)((char*)block + ALIGNMENT);
+    handle_entry* entry = get_handle_entry(h, handle);
+    if (entry == NULL || (*entry).link != to_link(h, block)) {
+        return 0;
+    }
+    return handle;
+}
+
+/* grow_handle_table
+----------------------
+ Doubles the handle table, threading the new entries onto the list of unused handles.
+
+ @param h: the heap
+ @return: true if the table grew, false if the heap is out of memory
+*/
+bool grow_handle_table(heap* h) {
+    size_t capacity = (*h).handle_capacity == 0 ? HANDLE_TABLE_INITIAL : (*h).handle_capacity * 2;
+    handle_entry* table = get_handle_table(h);
+    size_t guard_countdown = (*h).guard_countdown; //the table is reached through a link, so it stays in the heap
+    (*h).guard_countdown = 0;
+    table = (handle_entry*)myrealloc_ex(h, (void*)table, capacity * sizeof(handle_entry));
+    (*h).guard_countdown = guard_countdown;
+    if (table == NULL) {
+        return false;
+    }
+    for (size_t i = (*h).handle_capacity; i < capacity; i++) {
+        table[i].link = 0;
+        table[i].pins = i + 1 < capacity ? i + 2 : (*h).handle_free;
+        table[i].relocate = NULL;
+        table[i].context = NULL;
+    }
+    (*h).handle_free = (*h).handle_capacity + 1;
+    (*h).handle_table = to_link(h, (header*)((char*)table - ALIGNMENT));
+    (*h).handle_capacity = capacity;
     return true;
 }
 
-/* dump_heap
+/* handle_alloc
+-----------------
+ Allocates a block that is reached through a handle rather than a pointer, so that 
+ heap_compact may move it. The block is hidden behind a word holding its handle.
+
+ @param h: the heap to allocate from
+ @param requested_size: the size in bytes of the block
+ @return: the handle of the new block, or 0 if allocation failed
+*/
+heap_handle handle_alloc(heap* h, size_t requested_size) {
+    if (needs_lock(h)) {
+        if (!shared_lock(h)) {
+            return 0;
+        }
+        heap_handle result = handle_alloc(h, requested_size);
+        shared_unlock(h);
+        return result;
+    }
+    if (requested_size > MAX_REQUEST_SIZE - ALIGNMENT) {
+        return 0;
+    }
+    if ((*h).handle_free == 0 && !grow_handle_table(h)) {
+        return 0;
+    }
+    size_t guard_countdown = (*h).guard_countdown; //handles link to heap blocks, which compaction may move
+    (*h).guard_countdown = 0;
+    char* ptr = (char*)mymalloc_ex(h, requested_size + ALIGNMENT);
+    (*h).guard_countdown = guard_countdown;
+    if (ptr == NULL) {
+        return 0;
+    }
+
+    heap_handle handle = (*h).handle_free;
+    handle_entry* entry = &get_handle_table(h)[handle - 1];
+    (*h).handle_free = (*entry).pins;
+    (*entry).link = to_link(h, (header*)(ptr - ALIGNMENT));
+    (*entry).pins = 0;
+    *(heap_handle*)ptr = handle;
+    return handle;
+}
+
+/* handle_free
+----------------
+ Frees the block of a handle and makes the handle available for reuse.
+
+ @param h: the heap the handle was allocated from
+ @param handle: the handle, which must not be pinned
+*/
+void handle_free(heap* h, heap_handle handle) {
+    if (needs_lock(h)) {
+        if (shared_lock(h)) {
+            handle_free(h, handle);
+            shared_unlock(h);
+        }
+        return;
+    }
+    handle_entry* entry = get_handle_entry(h, handle);
+    if (entry == NULL) {
+        return;
+    }
+    header* block = from_link(h, (*entry).link);
+    myfree_ex(h, (char*)block + ALIGNMENT);
+    (*entry).link = 0;
+    (*entry).pins = (*h).handle_free;
+    (*entry).relocate = NULL;
+    (*entry).context = NULL;
+    (*h).handle_free = handle;
+}
+
+/* handle_pin
+---------------
+ Pins the block of a handle so it stays in place, and returns its address. Every pin must 
+ be matched by handle_unpin before compaction may move the block again.
+
+ @param h: the heap the handle was allocated from
+ @param handle: the handle
+ @return: pointer to the block's payload, or NULL if the handle is not in use
+*/
+void* handle_pin(heap* h, heap_handle handle) {
+    if (needs_lock(h)) {
+        if (!shared_lock(h)) {
+            return NULL;
+        }
+        void* result = handle_pin(h, handle);
+        shared_unlock(h);
+        return result;
+    }
+    handle_entry* entry = get_handle_entry(h, handle);
+    if (entry == NULL) {
+        return NULL;
+    }
+    (*entry).pins++;
+    return (char*)from_link(h, (*entry).link) + ALIGNMENT * 2;
+}
+
+/* handle_unpin
+-----------------
+ Releases one pin of a handle. Pointers obtained from handle_pin must not be used after 
+ the last pin is released.
+
+ @param h: the heap the handle was allocated from
+ @param handle: the handle
+*/
+void handle_unpin(heap* h, heap_handle handle) {
+    if (needs_lock(h)) {
+        if (shared_lock(h)) {
+            handle_unpin(h, handle);
+            shared_unlock(h);
+        }
+        return;
+    }
+    handle_entry* entry = get_handle_entry(h, handle);
+    if (entry != NULL && (*entry).pins > 0) {
+        (*entry).pins--;
+    }
+}
+
+/* close_gap
 --------------
- Prints the current state of the heap. It prints the payload size and the free/used status 
- of each block, as well as the total size of the heap and the total amount of free space.
+ Turns the space left behind by moved blocks into one free block on the free list.
+
+ @param h: the heap
+ @param gap: the start of the space
+ @param end: the end of the space
+ @return: the new free block
 */
-void dump_heap() {
-    char* index = (char*)segment_start;
-    header *block = segment_start;
+header* close_gap(heap* h, char* gap, char* end) {
+    header* block = (header*)gap;
+    (*block).payload = (unsigned long)(end - gap) - ALIGNMENT;
+    add_freelist(h, block);
+    return block;
+}
+
+/* heap_compact
+-----------------
+ Slides unpinned handle blocks and relocatable blocks towards the start of the segment over 
+ the free space in front of them, so that free space gathers into larger blocks. The owner 
+ of a relocatable block is told through its callback, by which time the old copy may 
+ already be overwritten. Pointer blocks and pinned 
+ handle blocks stay where they are and the free space in front of them is merged instead. 
+ With a budget, the step stops after moving about that many bytes or passing over 
+ COMPACT_SCAN_RATIO times as many in allocated blocks and free block headers, so a stretch 
+ of blocks that stay put cannot make it walk the whole heap, and the next call carries on 
+ from there. A step may therefore move nothing. A step only unlinks the free blocks 
+ it passes and links the gaps it leaves, so its cost follows the budget. A budget of 0 
+ compacts the whole heap and then consolidates it; budgeted steps leave deferred blocks 
+ to the next consolidation.
+
+ @param h: the heap to compact
+ @param budget: the number of bytes to move in this step, or 0 for no limit
+ @return: the number of bytes moved
+*/
+size_t heap_compact(heap* h, size_t budget) {
+    if (needs_lock(h)) {
+        if (!shared_lock(h)) {
+            return 0;
+        }
+        size_t result = heap_compact(h, budget);
+        shared_unlock(h);
+        return result;
+    }
+    header* resume = from_link(h, (*h).compact_cursor);
+    char* index = resume != NULL ? (char*)resume : (char*)get_segment_start(h);
+    char* end = (char*)get_heap_end(h);
+    char* gap = NULL; //start of the free space collected so far
+    size_t moved = 0;
+    size_t scanned = 0;
+
+    while (index < end && (budget == 0 || (moved < budget && scanned < budget * COMPACT_SCAN_RATIO))) {
+        header* block = (header*)index;
+        size_t size = get_payload(block) + ALIGNMENT;
+
+        if (check_free(block)) { //the block becomes part of the gap, at the cost of its header
+            scanned += ALIGNMENT;
+            remove_freelist(h, block);
+            if (gap == NULL) {
+                gap = index;
+            }
+            index += size;
+            continue;
+        }
+
+        scanned += size;
+        heap_handle handle = block_handle(h, block);
+        handle_entry* entry = handle != 0 ? &get_handle_table(h)[handle - 1] : NULL;
+        if (gap != NULL && entry != NULL && (*entry).pins == 0) { //slide the block down into the gap
+            memmove(gap, index, size);
+            (*entry).link = to_link(h, (header*)gap);
+            if ((*entry).relocate != NULL) {
+                (*(*entry).relocate)(index + ALIGNMENT * 2, gap + ALIGNMENT * 2, (*entry).context);
+            }
+            moved += size;
+            gap += size;
+        } else if (gap != NULL) {
+            close_gap(h, gap, index);
+            gap = NULL;
+        }
+        index += size;
+    }
+
+    header* stop = (header*)(gap != NULL ? gap : index); //block where the next step resumes
+    if (gap != NULL) {
+        coalesce(h, close_gap(h, gap, index)); //merge with a free block the step did not reach
+    }
+    (*h).stats.compactions++;
+    (*h).stats.bytes_compacted += moved;
+    if (budget == 0) { //a full pass also merges deferred blocks and anything else that now touches
+        heap_consolidate(h);
+        return moved;
+    }
+    (*h).check_cursor = to_link(h, get_segment_start(h)); //moved blocks may have held the cursors
+    (*h).defrag_cursor = 0;
+    (*h).compact_cursor = index < end ? to_link(h, stop) : 0; //the next pass starts over
+    return moved;
+}
+
+/* mymalloc_relocatable
+-------------------------
+ Allocates a block that the allocator may move while defragmenting. The block is used 
+ through an ordinary pointer; whenever it moves, the callback is given the old and new 
+ addresses so its owner can update every pointer to it. Relocatable blocks cannot be 
+ used in shared heaps, where the callback would mean nothing to the other processes.
+
+ @param h: the heap to allocate from
+ @param requested_size: the size in bytes of the block
+ @param relocate: the function called after the block has moved
+ @param context: passed to relocate
+ @return: a pointer to the block, or NULL if allocation failed
+*/
+void* mymalloc_relocatable(heap* h, size_t requested_size, heap_relocate_fn relocate, void* context) {
+    if (relocate == NULL || (*h).process_shared) {
+        return NULL;
+    }
+    heap_handle handle = handle_alloc(h, requested_size);
+    if (handle == 0) {
+        return NULL;
+    }
+    handle_entry* entry = &get_handle_table(h)[handle - 1];
+    (*entry).relocate = relocate;
+    (*entry).context = context;
+    return (char*)from_link(h, (*entry).link) + ALIGNMENT * 2;
+}
+
+/* myfree_relocatable
+-----------------------
+ Frees a block allocated with mymalloc_relocatable.
+
+ @param h: the heap the block was allocated from
+ @param ptr: pointer to the block, at its current address
+*/
+void myfree_relocatable(heap* h, void* ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+    handle_free(h, *(heap_handle*)((char*)ptr - ALIGNMENT));
+}
+
+/* find_hole
+--------------
+ Looks for a free block below a given address that can take a block of the given size. 
+ Only the first DEFRAG_SEARCH_LIMIT free-list nodes are examined, which bounds the cost of 
+ a defragmentation step. The free block in front of the moving block is excluded, along 
+ with any that ends right at it, so moving the block never merges into that neighbour.
+
+ @param h: the heap
+ @param request: the payload size needed
+ @param below: the block being moved
+ @param neighbour: the free block right before the moving block, or NULL
+ @return: a suitable free block, or NULL if none was found
+*/
+header* find_hole(heap* h, size_t request, header* below, header* neighbour) {
+    header* curr = from_link(h, (*h).freelist_start);
+    header* found = NULL;
+    size_t steps = 0;
+    while (curr != NULL && steps < DEFRAG_SEARCH_LIMIT) {
+        steps++;
+        char* hole_end = (char*)curr + get_payload(curr) + ALIGNMENT;
+        if (curr < below && curr != neighbour && hole_end != (char*)neighbour && get_payload(curr) >= request) {
+            found = curr;
+            break;
+        }
+        curr = next_free(h, curr);
+    }
+    (*h).stats.search_steps += steps;
+    return found;
+}
+
+/* relocate_block
+-------------------
+ Moves a handle block into a hole: the hole is allocated (split when large enough), the 
+ contents are copied, the handle table and the owner are updated, and the old block is 
+ freed and merged with its free neighbours.
+
+ @param h: the heap
+ @param block: the block to move
+ @param entry: the block's handle entry
+ @param hole: the free block to move it into
+ @param neighbour: the free block right before the moving block, or NULL
+ @return: the free block left where the moved block was, after merging
+*/
+header* relocate_block(heap* h, header* block, handle_entry* entry, header* hole, header* neighbour) {
+    size_t request = get_payload(block);
+    unsigned long hole_payload = get_payload(hole);
+    if (hole_payload >= request + (ALIGNMENT * 3)) {
+        add_block(h, hole, request);
+    } else {
+        remove_freelist(h, hole);
+        (*hole).payload += 1;
+        stats_count(h, hole_payload, false, 1);
+    }
+    memcpy((char*)hole + ALIGNMENT, (char*)block + ALIGNMENT, request);
+    (*entry).link = to_link(h, hole);
+    if ((*entry).relocate != NULL) {
+        (*(*entry).relocate)((char*)block + ALIGNMENT * 2, (char*)hole + ALIGNMENT * 2, (*entry).context);
+    }
+
+    stats_count(h, request, false, -1);
+    (*block).payload -= 1;
+    add_freelist(h, block);
+    coalesce(h, block);
+    if (neighbour != NULL) {
+        coalesce(h, neighbour);
+        return neighbour;
+    }
+    return block;
+}
+
+/* heap_defrag_step
+---------------------
+ Examines up to `budget` blocks, continuing from where the previous step stopped, and moves 
+ each movable block that sits next to free space into a hole lower in the heap, so the free 
+ space around it merges into one larger block. Movable blocks are unpinned handle blocks 
+ and relocatable blocks. Every step does a bounded amount of work, so it can run in idle 
+ time without pausing the program for a whole pass.
+
+ @param h: the heap to defragment
+ @param budget: the maximum number of blocks to examine
+ @return: what the step moved and the largest free block it created
+*/
+heap_defrag_result heap_defrag_step(heap* h, size_t budget) {
+    heap_defrag_result result;
+    memset(&result, 0, sizeof(result));
+    if (needs_lock(h)) {
+        if (shared_lock(h)) {
+            result = heap_defrag_step(h, budget);
+            shared_unlock(h);
+        }
+        return result;
+    }
+
+    header* resume = from_link(h, (*h).defrag_cursor);
+    char* index = resume != NULL ? (char*)resume : (char*)get_segment_start(h);
+    char* end = (char*)get_heap_end(h);
+    header* neighbour = NULL; //the block before index when it is free
+
+    for (size_t examined = 0; index < end && examined < budget; examined++) {
+        header* block = (header*)index;
+        index += get_payload(block) + ALIGNMENT;
+        if (check_free(block)) {
+            neighbour = block;
+            continue;
+        }
+
+        heap_handle handle = ((*block).payload & TRAILER_BIT) ? 0 : block_handle(h, block);
+        handle_entry* entry = handle != 0 ? &get_handle_table(h)[handle - 1] : NULL;
+        header* next = get_next_block(h, block);
+        bool isolated = neighbour != NULL || (next != NULL && check_free(next));
+        header* hole = NULL;
+        if (entry != NULL && (*entry).pins == 0 && isolated) {
+            hole = find_hole(h, get_payload(block), block, neighbour);
+        }
+        if (hole == NULL) {
+            neighbour = NULL;
+            continue;
+        }
+
+        result.blocks_moved++;
+        result.bytes_moved += get_payload(block);
+        header* freed = relocate_block(h, block, entry, hole, neighbour);
+        if (get_payload(freed) > result.largest_freed) {
+            result.largest_freed = get_payload(freed);
+        }
+        neighbour = freed;
+        index = (char*)freed + get_payload(freed) + ALIGNMENT;
+    }
+
+    result.pass_complete = index >= end;
+    (*h).defrag_cursor = index < end ? to_link(h, (header*)index) : 0;
+    (*h).stats.blocks_relocated += result.blocks_moved;
+    (*h).stats.bytes_relocated += result.bytes_moved;
+    return result;
+}
+
+/* mystats_ex
+---------------
+ Copies the statistics of a heap into the given struct. All counters are kept up to date 
+ by the allocator, so this is constant time except right after the largest free block 
+ was allocated or merged away. The new largest is then found once, from the group maxima 
+ of the search table when it is on, otherwise by walking the free list.
+
+ @param h: the heap to report on
+ @param stats: the struct to fill in
+*/
+void mystats_ex(heap* h, heap_stats* stats) {
+    if (needs_lock(h)) {
+        if (shared_lock(h)) {
+            mystats_ex(h, stats);
+            shared_unlock(h);
+        }
+        return;
+    }
+    search_table* t = (*h).table;
+    if ((*h).largest_free_stale && t != NULL && (*h).stats.largest_free / ALIGNMENT < INT32_MAX) {
+        uint32_t units = 0; //every free block with room for a slot has a table entry
+        for (size_t group = 0; group * TABLE_GROUP < (*t).count; group++) {
+            units = (*t).group_max[group] > units ? (*t).group_max[group] : units;
+        }
+        if (units == 0 && (*h).freelist_start != 0) { //only blocks too small for a slot are free
+            units = TABLE_MIN_PAYLOAD / ALIGNMENT - 1;
+        }
+        (*h).stats.largest_free = (size_t)units * ALIGNMENT;
+        (*h).largest_free_stale = false;
+    }
+    if ((*h).largest_free_stale) {
+        unsigned long largest = 0;
+        header* curr = from_link(h, (*h).freelist_start);
+        while (curr != NULL) {
+            if (get_payload(curr) > largest) {
+                largest = get_payload(curr);
+            }
+            curr = next_free(h, curr);
+        }
+        (*h).stats.largest_free = largest;
+        (*h).largest_free_stale = false;
+    }
+    *stats = (*h).stats;
+}
+
+/* mystats
+---------------
+ Copies the statistics of the default heap into the given struct.
+
+ @param stats: the struct to fill in
+*/
+void mystats(heap_stats* stats) {
+    mystats_ex(&default_heap, stats);
+}
+
+/* heap_layout_ex
+-------------------
+ Computes fragmentation metrics and block histograms for a heap. Headers are read strictly 
+ in address order and nothing is printed per block, so the walk runs at memory bandwidth 
+ even on heaps with millions of blocks.
 
-    while((void*)index != heap_end) {
+ @param h: the heap to summarize
+ @param layout: the struct to fill in
+*/
+void heap_layout_ex(heap* h, heap_layout* layout) {
+    memset(layout, 0, sizeof(heap_layout));
+    if (needs_lock(h)) {
+        if (shared_lock(h)) {
+            heap_layout_ex(h, layout);
+            shared_unlock(h);
+        }
+        return;
+    }
+    (*layout).segment_size = (*h).segment_size;
+
+    char* index = (char*)get_segment_start(h);
+    char* end = (char*)get_heap_end(h);
+    size_t run = 0;
+    bool run_free = false;
+
+    while (index < end) {
+        header* block = (header*)index;
         unsigned long payload_val = get_payload(block);
         bool free = check_free(block);
 
-        printf("Block at %p: payload=%lu, free=%s\n", index, payload_val, free ? "true" : "false");
-        
+        if (run > 0 && free != run_free) { //current run ends at this block
+            size_t* runs = run_free ? (*layout).free_runs : (*layout).allocated_runs;
+            runs[size_class(run)]++;
+            run = 0;
+        }
+        run_free = free;
+        run++;
+
+        if (free) {
+            (*layout).blocks_free++;
+            (*layout).bytes_free += payload_val;
+            (*layout).free_sizes[size_class(payload_val)]++;
+            if (payload_val > (*layout).largest_free) {
+                (*layout).largest_free = payload_val;
+            }
+        } else {
+            (*layout).blocks_allocated++;
+            (*layout).bytes_allocated += payload_val;
+        }
         index += payload_val + ALIGNMENT;
-        block = (header*)index;
     }
+
+    if (run > 0) {
+        size_t* runs = run_free ? (*layout).free_runs : (*layout).allocated_runs;
+        runs[size_class(run)]++;
+    }
+    if ((*layout).bytes_free > 0) {
+        (*layout).external_fragmentation = 1.0 - (double)(*layout).largest_free / (double)(*layout).bytes_free;
+    }
+}
+
+/* print_histogram
+--------------------
+ Writes one histogram of a heap layout, omitting the empty classes at the top end.
+
+ @param out: the stream to write to
+ @param name: the name of the histogram
+ @param counts: the counts for each class
+ @param format: JSON writes an array, CSV writes a row per class
+*/
+void print_histogram(FILE* out, const char* name, size_t* counts, heap_format format) {
+    size_t used = HEAP_STATS_CLASSES;
+    while (used > 0 && counts[used - 1] == 0) {
+        used--;
+    }
+
+    if (format == HEAP_FORMAT_CSV) {
+        for (size_t i = 0; i < used; i++) {
+            fprintf(out, "%s,%zu,%zu\n", name, i, counts[i]);
+        }
+        return;
+    }
+
+    fprintf(out, "\"%s\":[", name);
+    for (size_t i = 0; i < used; i++) {
+        fprintf(out, i == 0 ? "%zu" : ",%zu", counts[i]);
+    }
+    fprintf(out, "]");
+}
+
+/* dump_heap_layout_ex
+------------------------
+ Writes a compact snapshot of a heap's layout as a single JSON object or as CSV rows of 
+ (metric, class, value). Histogram entry k counts sizes or run lengths in [2^k, 2^(k+1)).
+
+ @param h: the heap to summarize
+ @param out: the stream to write to
+ @param format: HEAP_FORMAT_JSON or HEAP_FORMAT_CSV
+ @return: true if the snapshot was written successfully, false otherwise
+*/
+bool dump_heap_layout_ex(heap* h, FILE* out, heap_format format) {
+    heap_layout layout;
+    heap_layout_ex(h, &layout);
+
+    if (format == HEAP_FORMAT_CSV) {
+        fprintf(out, "metric,class,value\n");
+        fprintf(out, "segment_size,,%zu\n", layout.segment_size);
+        fprintf(out, "blocks_allocated,,%zu\n", layout.blocks_allocated);
+        fprintf(out, "blocks_free,,%zu\n", layout.blocks_free);
+        fprintf(out, "bytes_allocated,,%zu\n", layout.bytes_allocated);
+        fprintf(out, "bytes_free,,%zu\n", layout.bytes_free);
+        fprintf(out, "largest_free,,%zu\n", layout.largest_free);
+        fprintf(out, "external_fragmentation,,%.6f\n", layout.external_fragmentation);
+    } else {
+        fprintf(out, "{\"segment_size\":%zu,\"blocks_allocated\":%zu,\"blocks_free\":%zu,",
+                layout.segment_size, layout.blocks_allocated, layout.blocks_free);
+        fprintf(out, "\"bytes_allocated\":%zu,\"bytes_free\":%zu,\"largest_free\":%zu,",
+                layout.bytes_allocated, layout.bytes_free, layout.largest_free);
+        fprintf(out, "\"external_fragmentation\":%.6f,", layout.external_fragmentation);
+    }
+
+    print_histogram(out, "free_sizes", layout.free_sizes, format);
+    if (format == HEAP_FORMAT_JSON) {
+        fprintf(out, ",");
+    }
+    print_histogram(out, "allocated_runs", layout.allocated_runs, format);
+    if (format == HEAP_FORMAT_JSON) {
+        fprintf(out, ",");
+    }
+    print_histogram(out, "free_runs", layout.free_runs, format);
+    if (format == HEAP_FORMAT_JSON) {
+        fprintf(out, "}\n");
+    }
+
+    return !ferror(out);
+}
+
+/* dump_heap_layout
+---------------------
+ Writes a compact snapshot of the default heap's layout.
+
+ @param out: the stream to write to
+ @param format: HEAP_FORMAT_JSON or HEAP_FORMAT_CSV
+ @return: true if the snapshot was written successfully, false otherwise
+*/
+bool dump_heap_layout(FILE* out, heap_format format) {
+    return dump_heap_layout_ex(&default_heap, out, format);
+}
+
+/* heap_profile_start
+-----------------------
+ Starts (or resumes) sampling allocations from a heap. The profile tables are allocated 
+ with the C library on the first call and kept for the lifetime of the heap, so samples 
+ taken before heap_profile_stop() are still released when their blocks are freed.
+
+ @param h: the heap to profile
+ @param sample_period: the mean number of bytes allocated between samples
+ @return: true if profiling started, false if the tables could not be allocated
+*/
+bool heap_profile_start(heap* h, size_t sample_period) {
+    if (sample_period == 0 || (*h).process_shared) {
+        return false;
+    }
+    if ((*h).profile == NULL) {
+        (*h).profile = (heap_profile*)calloc(1, sizeof(heap_profile));
+        if ((*h).profile == NULL) {
+            return false;
+        }
+        (*(*h).profile).rng = (uint64_t)(uintptr_t)h ^ 0x9E3779B97F4A7C15ULL;
+    }
+
+    heap_profile* profile = (*h).profile;
+    (*profile).period = sample_period;
+    (*profile).sampling = true;
+    (*h).sample_countdown = next_sample_gap(profile);
+    return true;
+}
+
+/* heap_profile_stop
+----------------------
+ Stops taking new samples. Sampled blocks still live keep their site until they are freed.
+
+ @param h: the profiled heap
+*/
+void heap_profile_stop(heap* h) {
+    if ((*h).profile != NULL) {
+        (*(*h).profile).sampling = false;
+    }
+    (*h).sample_countdown = LONG_MAX;
+}
+
+/* dump_heap_profile_ex
+-------------------------
+ Writes the live and cumulative samples of each allocation site in the legacy text heap 
+ profile format ("heap_v2"), followed by the process memory map pprof uses to symbolize 
+ the addresses. Counts are the raw samples; pprof scales them by the sampling period.
+
+ @param h: the profiled heap
+ @param out: the stream to write to
+ @return: true if the profile was written successfully, false otherwise
+*/
+bool dump_heap_profile_ex(heap* h, FILE* out) {
+    heap_profile* profile = (*h).profile;
+    if (profile == NULL) {
+        return false;
+    }
+
+    size_t live_count = 0, live_bytes = 0, total_count = 0, total_bytes = 0;
+    for (size_t i = 0; i < PROFILE_SITES; i++) {
+        profile_site* site = &(*profile).sites[i];
+        live_count += (*site).live_count;
+        live_bytes += (*site).live_bytes;
+        total_count += (*site).total_count;
+        total_bytes += (*site).total_bytes;
+    }
+
+    fprintf(out, "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n",
+            live_count, live_bytes, total_count, total_bytes, (*profile).period);
+    for (size_t i = 0; i < PROFILE_SITES; i++) {
+        profile_site* site = &(*profile).sites[i];
+        if ((*site).depth == 0) {
+            continue;
+        }
+        fprintf(out, "%zu: %zu [%zu: %zu] @", (*site).live_count, (*site).live_bytes,
+                (*site).total_count, (*site).total_bytes);
+        for (size_t j = 0; j < (*site).depth; j++) {
+            fprintf(out, " %p", (*site).frames[j]);
+        }
+        fprintf(out, "\n");
+    }
+
+    fprintf(out, "\nMAPPED_LIBRARIES:\n");
+    FILE* maps = fopen("/proc/self/maps", "r");
+    if (maps != NULL) {
+        char line[512];
+        while (fgets(line, sizeof(line), maps) != NULL) {
+            fputs(line, out);
+        }
+        fclose(maps);
+    }
+    return !ferror(out);
+}
+
+/* dump_heap_profile
+----------------------
+ Writes the sampling profile of the default heap.
+
+ @param out: the stream to write to
+ @return: true if the profile was written successfully, false otherwise
+*/
+bool dump_heap_profile(FILE* out) {
+    return dump_heap_profile_ex(&default_heap, out);
+}
+
+/* heap_latency_enable
+------------------------
+ Turns latency recording for all heaps and threads on or off. Histograms recorded so far 
+ are kept.
+
+ @param enabled: whether entry points should be timed
+*/
+void heap_latency_enable(bool enabled) {
+    __atomic_store_n(&latency_enabled, enabled, __ATOMIC_RELAXED);
+}
+
+/* latency_histogram_merge
+----------------------------
+ Adds the counts of one histogram into another.
+
+ @param into: the histogram receiving the counts
+ @param from: the histogram whose counts are added
+*/
+void latency_histogram_merge(latency_histogram* into, const latency_histogram* from) {
+    uint64_t* dst = &(*into).counts[0][0][0];
+    const uint64_t* src = &(*from).counts[0][0][0];
+    size_t n = sizeof(latency_histogram) / sizeof(uint64_t);
+    for (size_t i = 0; i < n; i++) {
+        dst[i] += __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    }
+}
+
+/* heap_latency_snapshot
+--------------------------
+ Merges the histograms of every thread that has been timed into one histogram. Threads keep 
+ recording while the snapshot is taken, so it may include part of their concurrent calls.
+
+ @param snapshot: the histogram to fill in
+*/
+void heap_latency_snapshot(latency_histogram* snapshot) {
+    memset(snapshot, 0, sizeof(latency_histogram));
+    latency_thread* thread = __atomic_load_n(&latency_threads, __ATOMIC_ACQUIRE);
+    while (thread != NULL) {
+        latency_histogram_merge(snapshot, &(*thread).histogram);
+        thread = (*thread).next;
+    }
+}
+
+/* latency_histogram_percentile
+---------------------------------
+ Finds the duration below which the given fraction of calls completed.
+
+ @param histogram: the histogram to read
+ @param op: the entry point
+ @param size_class: the size class to read, or -1 for all size classes
+ @param percentile: the fraction of calls, between 0 and 100
+ @return: the upper bound in cycles of the bucket containing the percentile, or 0 if empty
+*/
+uint64_t latency_histogram_percentile(const latency_histogram* histogram, latency_op op, int size_class, double percentile) {
+    int first = size_class < 0 ? 0 : size_class;
+    int last = size_class < 0 ? LATENCY_SIZE_CLASSES - 1 : size_class;
+
+    uint64_t total = 0;
+    for (int c = first; c <= last; c++) {
+        for (size_t b = 0; b < LATENCY_BUCKETS; b++) {
+            total += (*histogram).counts[op][c][b];
+        }
+    }
+    if (total == 0) {
+        return 0;
+    }
+
+    uint64_t target = (uint64_t)((percentile / 100.0) * (double)total);
+    if (target >= total) {
+        target = total - 1;
+    }
+    uint64_t seen = 0;
+    for (size_t b = 0; b < LATENCY_BUCKETS; b++) {
+        for (int c = first; c <= last; c++) {
+            seen += (*histogram).counts[op][c][b];
+        }
+        if (seen > target) {
+            return latency_bucket_value(b);
+        }
+    }
+    return latency_bucket_value(LATENCY_BUCKETS - 1);
 }
\ No newline at end of file
@@ -0,0 +1,371 @@
+/* heap.h
+---------------
+ Extended interface to the heap allocators. The functions declared in allocator.h
+ all operate on a single default heap. The *_ex variants below take a heap handle
+ instead, so a process can host any number of independent heaps (one per subsystem
+ or per thread) without any locking between them. Both implicit.c and explicit.c
+ implement this interface.
+ */
+#ifndef HEAP_H
+#define HEAP_H
+
+#include "allocator.h"
+#include <stdio.h>
+#include <stdint.h>
+
+// opaque handle to a heap; the allocator keeps its bookkeeping at the start of the segment
+typedef struct heap heap;
+
+heap *myinit_ex(void *heap_start, size_t heap_size);
+void *mymalloc_ex(heap *h, size_t requested_size);
+void myfree_ex(heap *h, void *ptr);
+void *myrealloc_ex(heap *h, void *old_ptr, size_t new_size);
+bool validate_heap_ex(heap *h);
+void dump_heap_ex(heap *h);
+
+void dump_heap();
+heap *get_default_heap();
+
+/* Prefetching
+---------------
+ heap_set_prefetch() makes the heap walks issue software prefetches: list walks fetch the 
+ node after the next one while the current node is examined, and walks in address order 
+ read a few cache lines ahead. It pays off on heaps much larger than the last-level cache.
+ */
+void heap_set_prefetch(heap *h, bool enabled);
+
+/* Mapped heaps (explicit.c only)
+---------------
+ myinit_mapped() maps its own memory for a heap instead of using memory supplied by the 
+ caller. With HEAP_MAP_HUGE the segment is backed by 2 MiB pages: explicit huge pages 
+ (MAP_HUGETLB) when the system has them reserved, otherwise a 2 MiB aligned mapping 
+ marked MADV_HUGEPAGE for transparent huge pages. Requests of a huge page or more are 
+ then placed on huge-page boundaries, so they occupy whole pages of their own and the 
+ small objects share the remaining ones. heap_unmap() releases the mapping.
+ */
+#define HEAP_MAP_HUGE 1
+
+heap *myinit_mapped(size_t heap_size, int flags);
+void heap_unmap(heap *h);
+void *mymemalign_ex(heap *h, size_t alignment, size_t requested_size);
+
+/* Persistent heaps (explicit.c only)
+---------------
+ heap_open_persistent() keeps a heap in a file mapped with MAP_SHARED, so its contents 
+ outlive the process. The allocator stores offsets rather than pointers in its headers 
+ and state, which lets a later process map the file at any address and use the heap right 
+ away after validate_heap_ex() has checked it. Application data in the heap must do the 
+ same: store heap_offset() values instead of pointers, and keep the entry point with 
+ heap_set_root(). Release the heap with heap_unmap(), which flushes it to the file.
+ */
+heap *heap_open_persistent(const char *path, size_t heap_size);
+void heap_set_root(heap *h, void *root);
+void *heap_get_root(heap *h);
+size_t heap_offset(heap *h, void *ptr);
+void *heap_pointer(heap *h, size_t offset);
+
+/* Shared heaps (explicit.c only)
+---------------
+ heap_open_shared() places a heap in a POSIX shared memory object that any number of 
+ processes can open by name, each at its own address. One process can allocate a buffer, 
+ pass heap_offset() of it to another (through a pipe, a queue in the heap, ...), and the 
+ other reads it in place with heap_pointer() and eventually frees it. Operations on the 
+ heap are serialized by a robust process-shared mutex; if a process dies holding it, the 
+ next one validates the heap and carries on, or fails every further call if the heap was 
+ left damaged. Configure the heap before other processes attach to it. The profiler and 
+ corruption handlers are not available on shared heaps. heap_unmap() detaches a process 
+ and shm_unlink() removes the name.
+ */
+heap *heap_open_shared(const char *name, size_t heap_size);
+
+/* Snapshots (explicit.c only)
+---------------
+ heap_snapshot() writes the heap state and segment to a sparse file, leaving out the 
+ contents of free blocks. heap_restore() maps such a file back copy-on-write as a new, 
+ private heap, so restoring costs page faults on the parts that are used rather than a 
+ read of the whole file. Pointers into the old heap are found again with heap_get_root() 
+ and heap_offset()/heap_pointer(), as with persistent heaps.
+ */
+bool heap_snapshot(heap *h, const char *path);
+heap *heap_restore(const char *path);
+
+/* Statistics (explicit.c only)
+---------------
+ Counters maintained incrementally by mymalloc/myfree/myrealloc so that reading them 
+ with mystats() is cheap. The one exception is largest_free. After the largest free block 
+ is allocated or merged away, the next mystats() call finds the new largest by walking 
+ the free list, which is O(free blocks), or the search table's group maxima, which is 
+ O(free blocks / 64) when the table is on. Size classes are powers of two: class k counts blocks whose 
+ payload is in [2^k, 2^(k+1)), with the last class also holding everything larger.
+ */
+#define HEAP_STATS_CLASSES 40
+
+typedef struct heap_stats {
+    size_t bytes_allocated; // payload bytes in allocated blocks
+    size_t bytes_free; // payload bytes in free blocks
+    size_t blocks_allocated;
+    size_t blocks_free;
+    size_t allocated_per_class[HEAP_STATS_CLASSES];
+    size_t free_per_class[HEAP_STATS_CLASSES];
+    size_t largest_free; // payload of the largest free block
+    size_t freelist_length;
+    size_t malloc_calls;
+    size_t malloc_failures;
+    size_t search_steps; // free-list nodes visited by all mymalloc calls
+    size_t free_calls;
+    size_t coalesces;
+    size_t realloc_in_place;
+    size_t realloc_moved;
+    size_t blocks_checked; // blocks visited by incremental validation
+    size_t blocks_deferred; // freed blocks waiting on the quick list
+    size_t bytes_deferred;
+    size_t consolidations;
+    size_t purges; // free blocks whose pages were released
+    size_t bytes_purged;
+    size_t compactions;
+    size_t bytes_compacted; // bytes moved by heap_compact
+    size_t blocks_relocated; // blocks moved by heap_defrag_step
+    size_t bytes_relocated;
+} heap_stats;
+
+void mystats(heap_stats *stats);
+void mystats_ex(heap *h, heap_stats *stats);
+
+/* Heap layout (explicit.c only)
+---------------
+ Summary of the block layout computed by one sequential walk over the headers. Histograms 
+ use the same power-of-two classes as heap_stats: free_sizes counts free blocks by payload, 
+ and the run histograms count maximal runs of consecutive allocated (or free) blocks by 
+ their length in blocks.
+ */
+typedef struct heap_layout {
+    size_t segment_size;
+    size_t blocks_allocated;
+    size_t blocks_free;
+    size_t bytes_allocated;
+    size_t bytes_free;
+    size_t largest_free;
+    double external_fragmentation; // 1 - largest_free / bytes_free, 0 when nothing is free
+    size_t free_sizes[HEAP_STATS_CLASSES];
+    size_t allocated_runs[HEAP_STATS_CLASSES];
+    size_t free_runs[HEAP_STATS_CLASSES];
+} heap_layout;
+
+typedef enum heap_format {
+    HEAP_FORMAT_JSON,
+    HEAP_FORMAT_CSV
+} heap_format;
+
+void heap_layout_ex(heap *h, heap_layout *layout);
+bool dump_heap_layout_ex(heap *h, FILE *out, heap_format format);
+bool dump_heap_layout(FILE *out, heap_format format);
+
+/* Incremental validation (explicit.c only)
+---------------
+ validate_heap_step_ex() checks at most `budget` blocks per call, resuming where the 
+ previous call stopped, so integrity checking can run continuously at a fixed cost. 
+ heap_set_sampled_check() runs such a step automatically every `interval` calls to 
+ mymalloc_ex/myfree_ex. When a step finds a damaged block the handler is called with it 
+ (if it returns, the triggering call carries on); without a handler the allocator reports 
+ the block on stderr and aborts. 
+
+ Building explicit.c with -DSAFE_LINKING stores free-list links XORed with a per-heap 
+ secret and their own position, and checks them whenever they are followed. A link that 
+ decodes to a misaligned or out-of-range offset, or a free block whose neighbours do not 
+ point back at it, goes to the same handler at once, and the process then aborts even if 
+ the handler returns. This costs about 17% more instructions on a tight fixed-size 
+ malloc/free loop and about 21% on random-size churn, so it is off by default. Heap files 
+ are not interchangeable between builds with and without it.
+ */
+typedef void (*heap_corruption_handler)(heap *h, void *block);
+
+bool validate_heap_step_ex(heap *h, size_t budget);
+bool validate_heap_step(size_t budget);
+void heap_set_sampled_check(heap *h, size_t interval, size_t budget, heap_corruption_handler handler);
+
+/* Size classes (explicit.c only)
+---------------
+ heap_set_size_classes() rounds requests of up to 64 KiB up to one of 47 size classes: 16, 24 
+ and 32 bytes, then four classes per doubling (40, 48, 56, 64, 80, 96, ...). A block 
+ freed by one request then fits any later request of the same class, at the cost of at 
+ most a quarter of the block in padding. heap_good_size() returns the payload a request 
+ gets, with or without size classes.
+ */
+void heap_set_size_classes(heap *h, bool enabled);
+size_t heap_good_size(heap *h, size_t size);
+
+/* Cache-line placement (explicit.c only)
+---------------
+ heap_set_cache_lines() places every request of at least min_size bytes on a cache line 
+ boundary and pads it to the end of its last line, so two such blocks never share a line 
+ and threads updating them do not slow each other down through false sharing. Each block 
+ costs up to a line of padding. Pass 0 to turn it off. heap_compact() and 
+ heap_defrag_step() do not keep the placement: a block they move keeps its padded size but 
+ may no longer start on a line boundary.
+ */
+void heap_set_cache_lines(heap *h, size_t min_size);
+
+/* Guarded sampling (explicit.c only)
+---------------
+ heap_set_guarded_sampling() serves about one in every rate calls to mymalloc_ex() from a 
+ pool of slots, each a page between two inaccessible guard pages, with the block placed 
+ against the guard page after it. myfree_ex() makes the page inaccessible again and the 
+ slot is reused only after the other freed slots. An overflow or a use after free of a 
+ sampled block then faults at once, and a SIGSEGV handler prints the faulting address 
+ with the stacks that allocated and freed the block before the process dies as usual. 
+ Requests larger than a page less 8 bytes are never sampled. Guarded blocks live outside 
+ the heap, so they are left out of the block and byte statistics and must not be passed to 
+ heap_offset() or heap_set_root(). Not available for shared or persistent heaps. A rate of 0 
+ stops sampling. Each sample costs two mprotect() calls, a few microseconds, so a rate of 
+ 1000 adds a few percent to a busy allocation loop and a rate of 10000 well under one.
+ */
+bool heap_set_guarded_sampling(heap *h, size_t rate, size_t slots);
+
+/* Deferred coalescing (explicit.c only)
+---------------
+ With deferred freeing enabled, blocks whose payload is at most `max_size` (capped at 
+ 1024 bytes) are not merged when freed. They wait on a quick list holding only blocks of 
+ their exact size, so a later request of that size is served by popping the list head 
+ without searching, splitting or merging. Deferred blocks are merged in one linear sweep over the heap by 
+ heap_consolidate(), which runs by itself when more than `max_deferred` blocks are waiting 
+ or when an allocation would otherwise fail.
+ */
+void heap_set_deferred_free(heap *h, size_t max_size, size_t max_deferred);
+void heap_consolidate(heap *h);
+
+/* Purging (explicit.c only)
+---------------
+ With purging enabled, a free block of at least 8 KiB that stays unused for `delay_ms` 
+ milliseconds has the pages inside it released back to the system with MADV_DONTNEED 
+ (or MADV_FREE with HEAP_PURGE_LAZY), so the resident size shrinks after a burst of 
+ allocations. The check is amortized over calls to myfree_ex; heap_purge() releases every 
+ large free block at once. Pages purged with MADV_DONTNEED in a heap created by 
+ myinit_mapped read back as zero, which mycalloc_ex uses to skip clearing them.
+ */
+#define HEAP_PURGE_LAZY 1
+
+void heap_set_purge(heap *h, uint64_t delay_ms, int flags);
+size_t heap_purge(heap *h);
+void *mycalloc_ex(heap *h, size_t count, size_t size);
+void *mycalloc(size_t count, size_t size);
+
+/* Sampling heap profiler (explicit.c only)
+---------------
+ Once started, about one allocation per `sample_period` bytes is sampled (the gaps are 
+ exponentially distributed, so every byte is equally likely to be picked). A sampled 
+ allocation records the call stack that made it, found by walking frame pointers, so 
+ the program must be compiled with -fno-omit-frame-pointer for deep stacks. Freeing a 
+ sampled block subtracts it from its site again. dump_heap_profile_ex() writes the 
+ sites in the legacy text heap profile format understood by pprof.
+ */
+bool heap_profile_start(heap *h, size_t sample_period);
+void heap_profile_stop(heap *h);
+bool dump_heap_profile_ex(heap *h, FILE *out);
+bool dump_heap_profile(FILE *out);
+
+/* Latency histograms (explicit.c only)
+---------------
+ When enabled, every call to mymalloc_ex/myfree_ex/myrealloc_ex is timed in CPU cycles and 
+ counted in a histogram owned by the calling thread, so recording never contends between 
+ threads. When a thread exits, its histogram keeps its counts and is handed to the next 
+ new thread, so memory grows with the most threads alive at once, not with every thread 
+ ever started. Histograms are log-linear: values below 2^LATENCY_SUB_BITS have a bucket each, 
+ and every power of two above that is split into 2^LATENCY_SUB_BITS equal buckets, giving 
+ about 6% relative precision. Calls are further split by operation and by size class 
+ (class c holds requests of at most 16 * 4^c bytes, the last class everything larger).
+ */
+#define LATENCY_SUB_BITS 4
+#define LATENCY_BUCKETS ((40 - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS)
+#define LATENCY_SIZE_CLASSES 8
+
+typedef enum latency_op {
+    LATENCY_MALLOC,
+    LATENCY_FREE,
+    LATENCY_REALLOC,
+    LATENCY_OPS
+} latency_op;
+
+typedef struct latency_histogram {
+    uint64_t counts[LATENCY_OPS][LATENCY_SIZE_CLASSES][LATENCY_BUCKETS];
+} latency_histogram;
+
+void heap_latency_enable(bool enabled);
+void heap_latency_snapshot(latency_histogram *snapshot);
+void latency_histogram_merge(latency_histogram *into, const latency_histogram *from);
+uint64_t latency_histogram_percentile(const latency_histogram *histogram, latency_op op, int size_class, double percentile);
+
+/* Arenas (explicit.c only)
+---------------
+ An arena carves a single block out of a heap and hands out pieces of it with a bump 
+ pointer. Pieces carry no header and cannot be freed individually; instead the whole 
+ arena is released at once with arena_reset(), or rolled back to an earlier checkpoint. 
+ Requests that do not fit in the arena fall back to mymalloc_ex() on the parent heap 
+ and are released along with everything else.
+ */
+typedef struct arena arena;
+
+// position of an arena returned by arena_checkpoint(), to be passed to arena_rollback()
+typedef struct arena_mark {
+    size_t used;
+    void *oversize;
+} arena_mark;
+
+arena *arena_create(heap *h, size_t capacity);
+void *arena_alloc(arena *a, size_t requested_size);
+arena_mark arena_checkpoint(arena *a);
+void arena_rollback(arena *a, arena_mark mark);
+void arena_reset(arena *a);
+void arena_destroy(arena *a);
+
+/* Handles and compaction (explicit.c only)
+---------------
+ Blocks allocated with handle_alloc() are reached through a handle instead of a pointer, 
+ which lets heap_compact() slide them together so that the free space between them merges 
+ into large blocks. A handle is turned into a pointer with handle_pin(); the block stays 
+ put until the matching handle_unpin(). Compaction can run over the whole heap at once or 
+ a few bytes at a time. A budgeted step also stops after passing over a bounded stretch of 
+ blocks that stay put, so it may move nothing; the next step carries on from there. Handles are offsets into a table kept in the heap, so they remain 
+ valid in persistent and shared heaps.
+ */
+typedef size_t heap_handle;
+
+heap_handle handle_alloc(heap *h, size_t requested_size);
+void handle_free(heap *h, heap_handle handle);
+void *handle_pin(heap *h, heap_handle handle);
+void handle_unpin(heap *h, heap_handle handle);
+size_t heap_compact(heap *h, size_t budget);
+
+/* Cooperative defragmentation (explicit.c only)
+---------------
+ Relocatable blocks are used through ordinary pointers, but their owner registers a 
+ callback that is told the new address whenever the allocator moves the block. 
+ heap_defrag_step() does a bounded amount of work: it looks at the next `budget` blocks and 
+ moves movable ones that sit between free blocks into holes lower in the heap, so the space 
+ they leave merges with its neighbours. Run it from idle time until pass_complete is set 
+ and nothing more moves.
+ */
+typedef void (*heap_relocate_fn)(void *old_ptr, void *new_ptr, void *context);
+
+typedef struct heap_defrag_result {
+    size_t blocks_moved;
+    size_t bytes_moved;
+    size_t largest_freed; // payload of the largest free block the step created
+    bool pass_complete; // the step reached the end of the heap; the next one starts over
+} heap_defrag_result;
+
+void *mymalloc_relocatable(heap *h, size_t requested_size, heap_relocate_fn relocate, void *context);
+void myfree_relocatable(heap *h, void *ptr);
+heap_defrag_result heap_defrag_step(heap *h, size_t budget);
+
+/* Search table (explicit.c only)
+---------------
+ With the search table on, the size of every free block is also kept in one dense array 
+ together with the largest size of every 64 entries. Allocation scans the maxima and then 
+ a single group, eight sizes per compare with AVX2 or four with SSE2 as CPUID reports, 
+ instead of following the free list from header to header. The table lives in process memory. It is rebuilt 
+ when turned on and is not available for heaps shared between processes. Persistent heaps 
+ and snapshots come back with it off.
+ */
+bool heap_set_search_table(heap *h, bool enabled);
+
+#endif
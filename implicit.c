@@ -2,21 +2,45 @@
  * This program implements an implicit heap allocator for managing heap memory. 
  * It maintains information about memory blocks using 'header' structures which store payload sizes.
  * Since all addresses and payload values must be multiples of 8, the three least significant bits (LSB) of the payload are used to store the allocation status of each memory block. 
+ *
+ * Building with -DCOMPACT_HEADER shrinks the header to a 32-bit word holding the block size in units of 
+ * ALIGNMENT, shifted left by one, with the allocation status in the lowest bit. Headers then sit 4 bytes 
+ * before an aligned payload, so payloads are 4 bytes short of a multiple of ALIGNMENT and a block is 
+ * limited to 16 GiB. A larger heap starts out as several free blocks of at most 16 GiB each, so no 
+ * single request can exceed that size.
  */
 #include "allocator.h"
+#include "heap.h"
 #include "debug_break.h"
 #include <stdio.h>
+#include <stdint.h>
 #include <string.h>
 #include <assert.h>
 
+#ifdef COMPACT_HEADER
+/* Each block in the heap begins with a header. The header stores the size of the whole block in units of ALIGNMENT. */
+typedef struct header{
+    uint32_t size_word;
+} header;
+#else
 /* Each block in the heap begins with a header. The header stores the payload size of the block. */
 typedef struct header{
     unsigned long payload_size;
 } header;
+#endif
+
+#define HEADER_SIZE sizeof(header) // Bytes between the start of a block and its payload
+#define PREFETCH_AHEAD 256 // Bytes read ahead of a block walk when prefetching is on
+
+/* The state of one heap instance. */
+struct heap {
+    header* segment_start; // Pointer to the first block header
+    size_t segment_size; // Total size of the memory segment
+    void* heap_end; // Pointer to the end of the memory segment
+    bool prefetch; // Whether block walks prefetch ahead
+};
 
-header* segment_start; // Pointer to the start of the memory segment
-size_t segment_size; // Total size of the memory segment
-void* heap_end; // Pointer to the end of the memory segment
+heap default_heap; // Heap used by the allocator.h interface
 
 const unsigned long FREE_MASK = 7; // Mask to extract the allocation status from the payload size
 const unsigned long PAYLOAD_MASK = ~7; // Mask to extract the payload size from the header
@@ -35,76 +59,202 @@ size_t roundup(size_t sz, size_t mult) {
     return (sz + mult - 1) & ~(mult - 1);
 }
 
-/* myinit
+/* get_payload
+------------
+ This function returns the payload size of a block, without its status bits.
+
+ @param block: the block header
+ @return: the payload size in bytes
+*/
+unsigned long get_payload(header* block) {
+#ifdef COMPACT_HEADER
+    return (unsigned long)((*block).size_word >> 1) * ALIGNMENT - HEADER_SIZE;
+#else
+    return (*block).payload_size & PAYLOAD_MASK;
+#endif
+}
+
+/* check_free
+------------
+ This function tells whether a block is free.
+
+ @param block: the block header
+ @return: true if the block is free, false if it is allocated
+*/
+bool check_free(header* block) {
+#ifdef COMPACT_HEADER
+    return !((*block).size_word & 1);
+#else
+    return !((*block).payload_size & FREE_MASK);
+#endif
+}
+
+/* set_header
+------------
+ This function writes a block header.
+
+ @param block: the block header
+ @param payload: the payload size in bytes, as returned by payload_for
+ @param used: whether the block is allocated
+ @return: void
+*/
+void set_header(header* block, unsigned long payload, bool used) {
+#ifdef COMPACT_HEADER
+    (*block).size_word = (uint32_t)(((payload + HEADER_SIZE) / ALIGNMENT) << 1) | (used ? 1 : 0);
+#else
+    (*block).payload_size = payload | (used ? 1 : 0);
+#endif
+}
+
+/* payload_for
+------------
+ This function returns the payload size of the smallest block that can hold a request, 
+ so that the block as a whole stays a multiple of ALIGNMENT.
+
+ @param requested_size: the requested size in bytes
+ @return: the payload size of the block
+*/
+size_t payload_for(size_t requested_size) {
+    return roundup(requested_size + HEADER_SIZE, ALIGNMENT) - HEADER_SIZE;
+}
+
+/* init_segment
 -----------
  This function initializes the heap segment. It does this by setting up the heap_start, 
- heap_size, and heap_end variables. The heap initially starts with a single free block. 
- If the heap size is too small to be useful, the function returns false.
+ heap_size, and heap_end variables. The heap initially starts with a single free block, or 
+ under COMPACT_HEADER with as many free blocks of the largest size a header can hold as 
+ the segment needs. If the heap size is too small to be useful, the function returns false.
 
+ @param h: the heap whose state is initialized
  @param heap_start: pointer to the start of the heap
  @param heap_size: the size of the heap
  @return: true if successful, false otherwise
 */
-bool myinit(void *heap_start, size_t heap_size) {
+bool init_segment(heap* h, void *heap_start, size_t heap_size) {
     if (heap_size < ALIGNMENT * 2) { //check for min heap_size
         return false;
     }
 
-    segment_start = (header*)heap_start;
-    segment_size = heap_size;
-    heap_end = (char*)heap_start + heap_size;
-    (*segment_start).payload_size = segment_size - ALIGNMENT;
+    size_t pad = ALIGNMENT - HEADER_SIZE; //the first header sits just before an aligned payload
+    size_t usable = (heap_size - pad) & ~(size_t)(ALIGNMENT - 1);
+    (*h).segment_start = (header*)((char*)heap_start + pad);
+    (*h).segment_size = heap_size;
+    (*h).heap_end = (char*)(*h).segment_start + usable;
+    char* block = (char*)(*h).segment_start;
+#ifdef COMPACT_HEADER
+    size_t max_block = (size_t)(UINT32_MAX >> 1) * ALIGNMENT; //largest block the size word can hold
+    while (usable > max_block) {
+        set_header((header*)block, max_block - HEADER_SIZE, false);
+        block += max_block;
+        usable -= max_block;
+    }
+#endif
+    set_header((header*)block, usable - HEADER_SIZE, false);
+    (*h).prefetch = false;
     return true;
 }
 
-/* mymalloc
+/* myinit_ex
+-----------
+ This function creates an independent heap in the given memory. The heap state is 
+ stored at the start of the memory and the remainder becomes the heap segment.
+
+ @param heap_start: pointer to the start of the memory
+ @param heap_size: the size of the memory
+ @return: a handle to the new heap, or NULL if the memory is too small
+*/
+heap* myinit_ex(void *heap_start, size_t heap_size) {
+    size_t state_size = roundup(sizeof(heap), ALIGNMENT);
+    if (heap_size < state_size) {
+        return NULL;
+    }
+
+    heap* h = (heap*)heap_start;
+    if (!init_segment(h, (char*)heap_start + state_size, heap_size - state_size)) {
+        return NULL;
+    }
+    return h;
+}
+
+/* myinit
+-----------
+ This function initializes the default heap, whose state lives outside the segment.
+
+ @param heap_start: pointer to the start of the heap
+ @param heap_size: the size of the heap
+ @return: true if successful, false otherwise
+*/
+bool myinit(void *heap_start, size_t heap_size) {
+    return init_segment(&default_heap, heap_start, heap_size);
+}
+
+/* heap_set_prefetch
+-------------------
+ This function turns prefetching in the block walks on or off. When it is on, each walk 
+ asks for the memory PREFETCH_AHEAD bytes past the block it is looking at.
+
+ @param h: the heap to configure
+ @param enabled: true to prefetch ahead of each walk
+ @return: void
+*/
+void heap_set_prefetch(heap* h, bool enabled) {
+    (*h).prefetch = enabled;
+}
+
+/* mymalloc_ex
 -------------
  This function attempts to allocate a block of memory on the heap of size 'requested_size'. 
  It iteratively checks each block in the heap until it finds a free block that is big enough to 
  satisfy the request. In case of the last block, it attempts to split it if it's possible. 
  If allocation fails, it returns NULL.
 
+ @param h: the heap to allocate from
  @param requested_size: the requested size for the new block
  @return: a pointer to the allocated block, or NULL if allocation failed
 */
-void *mymalloc(size_t requested_size) {
+void *mymalloc_ex(heap* h, size_t requested_size) {
      if (requested_size == 0) {
         return NULL;
     }
      
-    size_t request = roundup(requested_size, ALIGNMENT);
-    char* index = (char*)segment_start;
-    header* block = segment_start;
+    size_t request = payload_for(requested_size);
+    void* heap_end = (*h).heap_end;
+    char* index = (char*)(*h).segment_start;
+    header* block = (*h).segment_start;
 
     while((void*)index != heap_end) {
-        unsigned long payload = (*block).payload_size;
-        bool free = !(payload & FREE_MASK);
-        unsigned long payload_value = payload & PAYLOAD_MASK;
+        if ((*h).prefetch) {
+            __builtin_prefetch(index + PREFETCH_AHEAD);
+        }
+        bool free = check_free(block);
+        unsigned long payload_value = get_payload(block);
         
-        if (index + payload_value + ALIGNMENT == heap_end) { //last block case
+        if (index + payload_value + HEADER_SIZE == heap_end) { //last block case
 
             if (!free || request > payload_value) { //last block not free
                 return NULL;
             } 
 
-            if (free && payload_value >= request + (ALIGNMENT * 2)) { //add another header
-                (*block).payload_size = request + 1;
-                header* new = (header*)(index + request + ALIGNMENT); 
-                (*new).payload_size = payload_value - request - ALIGNMENT;
-                return (void*)(index + ALIGNMENT);
+            if (free && payload_value >= request + HEADER_SIZE + ALIGNMENT) { //add another header
+                set_header(block, request, true);
+                header* new = (header*)(index + request + HEADER_SIZE); 
+                set_header(new, payload_value - request - HEADER_SIZE, false);
+                return (void*)(index + HEADER_SIZE);
             }
 
-            (*block).payload_size = request + 1; //just fits in last block
-            return (void*)(index + ALIGNMENT);
+            //the last block keeps its whole payload: shrinking it to the request would leave 
+            //bytes past the last header that no walk could reach
+            set_header(block, payload_value, true); //just fits in last block
+            return (void*)(index + HEADER_SIZE);
             
         } else { //not on last block, check free and fits
 
             if (free && payload_value >= request) { //curr block fit
-                (*block).payload_size += 1;
-                return (void*)(index + ALIGNMENT);
+                set_header(block, payload_value, true);
+                return (void*)(index + HEADER_SIZE);
             } 
 
-            index += payload_value + ALIGNMENT; //move onto next block
+            index += payload_value + HEADER_SIZE; //move onto next block
             block = (header*)index;
             
         }      
@@ -112,101 +262,167 @@ void *mymalloc(size_t requested_size) {
     return NULL;
 }
 
-/* myfree
+/* mymalloc
+-------------
+ This function allocates a block from the default heap.
+
+ @param requested_size: the requested size for the new block
+ @return: a pointer to the allocated block, or NULL if allocation failed
+*/
+void *mymalloc(size_t requested_size) {
+    return mymalloc_ex(&default_heap, requested_size);
+}
+
+/* myfree_ex
 -----------
  This function attempts to free the block pointed to by 'ptr'. It does this by 
  updating the payload size of the block's header to indicate that it is free. 
  If 'ptr' is NULL, the function does nothing.
 
+ @param h: the heap the block was allocated from
  @param ptr: the pointer to the block to be freed
  @return: void
 */
-void myfree(void *ptr) {
+void myfree_ex(heap* h, void *ptr) {
+    (void)h; // freeing only touches the block's own header
     if (ptr == NULL) {
         return;
     }
-    header* block = (header*)((char*)ptr - ALIGNMENT);
-    (*block).payload_size -= 1;
+    header* block = (header*)((char*)ptr - HEADER_SIZE);
+    set_header(block, get_payload(block), false);
 }
 
-/* myrealloc
+/* myfree
+-----------
+ This function frees a block allocated from the default heap.
+
+ @param ptr: the pointer to the block to be freed
+ @return: void
+*/
+void myfree(void *ptr) {
+    myfree_ex(&default_heap, ptr);
+}
+
+/* myrealloc_ex
 --------------
  This function changes the size of the block pointed to by 'old_ptr' to 'new_size'. 
  If 'old_ptr' is NULL, it behaves like mymalloc. If 'new_size' is 0, it behaves like 
  myfree. It also copies the contents from the old block to the new one, and then frees 
  the old block.
 
+ @param h: the heap the block was allocated from
  @param old_ptr: the pointer to the block to be reallocated
  @param new_size: the new size for the block
  @return: a pointer to the newly allocated block, or NULL if reallocation failed
 */
-void *myrealloc(void *old_ptr, size_t new_size) {
+void *myrealloc_ex(heap* h, void *old_ptr, size_t new_size) {
     if (old_ptr == NULL) { 
-        return mymalloc(new_size);
+        return mymalloc_ex(h, new_size);
     }
 
     if (old_ptr != NULL && new_size == 0) {
-        myfree(old_ptr);
+        myfree_ex(h, old_ptr);
         return NULL; 
     } 
 
-    void* new_ptr = mymalloc(new_size);
+    void* new_ptr = mymalloc_ex(h, new_size);
     void* check = memcpy(new_ptr, old_ptr, new_size);
     assert(check != NULL);
-    myfree(old_ptr);
+    myfree_ex(h, old_ptr);
     return new_ptr;
 }
 
-/* validate_heap
+/* myrealloc
+--------------
+ This function resizes a block allocated from the default heap.
+
+ @param old_ptr: the pointer to the block to be reallocated
+ @param new_size: the new size for the block
+ @return: a pointer to the newly allocated block, or NULL if reallocation failed
+*/
+void *myrealloc(void *old_ptr, size_t new_size) {
+    return myrealloc_ex(&default_heap, old_ptr, new_size);
+}
+
+/* validate_heap_ex
 -----------------
  This function checks the validity of the heap. It iteratively checks each block in the 
  heap to ensure that it fits within the heap segment. It returns false if a block is 
  found that goes outside the heap segment.
 
+ @param h: the heap to validate
  @return: true if the heap is valid, false otherwise
 */
-bool validate_heap() {
-    char* index = (char*)segment_start;
-    header* block = segment_start;
+bool validate_heap_ex(heap* h) {
+    void* heap_end = (*h).heap_end;
+    char* index = (char*)(*h).segment_start;
+    header* block = (*h).segment_start;
   
     while ((void*)index != heap_end) {
-        unsigned long payload = (*block).payload_size;
-        unsigned long payload_val = payload & PAYLOAD_MASK;
-
         if (index > (char*)heap_end) {
             return false; //block goes outside heap segment
         }   
+        if ((*h).prefetch) {
+            __builtin_prefetch(index + PREFETCH_AHEAD);
+        }
+        unsigned long payload_val = get_payload(block);
 
-        index += payload_val + ALIGNMENT; //move onto next block
+        index += payload_val + HEADER_SIZE; //move onto next block
         block = (header*)index;            
     }       
 
     return true;
 }
 
-/* dump_heap
+/* validate_heap
+-----------------
+ This function checks the validity of the default heap.
+
+ @return: true if the heap is valid, false otherwise
+*/
+bool validate_heap() {
+    return validate_heap_ex(&default_heap);
+}
+
+/* dump_heap_ex
 --------------
  This function prints the contents of the heap for debugging purposes. For each block, 
- it prints the block address, the payload size (including the status bits), and the 
+ it prints the block address, the raw header word (including the status bits), and the 
  payload size (excluding the status bits).
 
+ @param h: the heap to print
  @return: void
 */
-void dump_heap() {
-    char* index = (char*)segment_start;
-    header* block = segment_start;
+void dump_heap_ex(heap* h) {
+    void* heap_end = (*h).heap_end;
+    char* index = (char*)(*h).segment_start;
+    header* block = (*h).segment_start;
 
     while ((void*)index != heap_end) {
-        unsigned long payload = (*block).payload_size;
-        unsigned long payload_val = payload & PAYLOAD_MASK;
+        if ((*h).prefetch) {
+            __builtin_prefetch(index + PREFETCH_AHEAD);
+        }
+        unsigned long payload_val = get_payload(block);
 
         printf("address: %p", (void*)block);
-        printf(" header: %lu", payload);
+#ifdef COMPACT_HEADER
+        printf(" header: %lu", (unsigned long)(*block).size_word);
+#else
+        printf(" header: %lu", (*block).payload_size);
+#endif
         printf(" payload: %lu\n", payload_val);
 
-        index += payload_val + ALIGNMENT; //move onto next block
+        index += payload_val + HEADER_SIZE; //move onto next block
         block = (header*)index;            
     }       
 }
 
-    
\ No newline at end of file
+/* dump_heap
+--------------
+ This function prints the contents of the default heap.
+
+ @return: void
+*/
+void dump_heap() {
+    dump_heap_ex(&default_heap);
+}